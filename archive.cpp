@@ -0,0 +1,484 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#endif
+
+#include "archive.h"
+#include "macho.h"
+
+namespace SigTool {
+
+// Buffered reading from one descriptor and writing to another, which
+// passes runs of bytes straight through when it can.
+class ArchiveStream {
+public:
+    ArchiveStream(int in, int out) : in(in), out(out), buf(64 * 1024) {}
+
+    // Make at least count bytes available to peek at, returning fewer only at
+    // the end of the input
+    size_t fill(size_t count) {
+        if (end - start >= count) {
+            return end - start;
+        }
+        if (start > 0) {
+            std::copy(buf.begin() + start, buf.begin() + end, buf.begin());
+            end -= start;
+            start = 0;
+        }
+        while (end < count) {
+            ssize_t result = ::read(in, &buf[end], buf.size() - end);
+            if (result == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error{std::string{"reading archive: "} + strerror(errno)};
+            }
+            if (result == 0) {
+                break;
+            }
+            end += result;
+        }
+        return end - start;
+    }
+
+    const char *peek() const {
+        return &buf[start];
+    }
+
+    std::string read(uint64_t count) {
+        std::string bytes;
+        bytes.reserve(count);
+        while (bytes.size() < count) {
+            size_t available = fill(std::min<uint64_t>(count - bytes.size(), buf.size()));
+            if (available == 0) {
+                throw std::runtime_error{"unexpected end of archive"};
+            }
+            size_t take = std::min<uint64_t>(available, count - bytes.size());
+            bytes.append(&buf[start], take);
+            start += take;
+        }
+        return bytes;
+    }
+
+    void write(const std::string &bytes) {
+        write(bytes.data(), bytes.size());
+    }
+
+    // Copy count bytes from the input to the output
+    void copy(uint64_t count) {
+        size_t buffered = std::min<uint64_t>(count, end - start);
+        write(&buf[start], buffered);
+        start += buffered;
+        count -= buffered;
+
+        transfer(count);
+
+        while (count > 0) {
+            size_t available = fill(1);
+            if (available == 0) {
+                throw std::runtime_error{"unexpected end of archive"};
+            }
+            size_t take = std::min<uint64_t>(available, count);
+            write(&buf[start], take);
+            start += take;
+            count -= take;
+        }
+    }
+
+    // Copy whatever follows, such as the padding after the end of a tar archive
+    void copyRest() {
+        while (fill(1) > 0) {
+            write(&buf[start], end - start);
+            start = end;
+        }
+    }
+
+private:
+    int in;
+    int out;
+    std::vector<char> buf;
+    size_t start = 0;
+    size_t end = 0;
+
+    bool canSplice = true;
+    bool canSendfile = true;
+
+    void write(const char *bytes, size_t count) {
+        while (count > 0) {
+            ssize_t result = ::write(out, bytes, count);
+            if (result == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error{std::string{"writing archive: "} + strerror(errno)};
+            }
+            bytes += result;
+            count -= result;
+        }
+    }
+
+    // Move bytes between the descriptors in the kernel: splice when either is
+    // a pipe, sendfile when the input is a file. Whatever cannot be moved
+    // this way is left for the caller to copy.
+    void transfer(uint64_t &count) {
+#ifdef __linux__
+        constexpr const uint64_t chunk = 1 << 20;
+
+        while (count > 0 && canSplice) {
+            ssize_t moved = splice(in, nullptr, out, nullptr, std::min(count, chunk), SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (moved == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EINVAL) {
+                    throw std::runtime_error{std::string{"splice: "} + strerror(errno)};
+                }
+                canSplice = false;
+            } else if (moved == 0) {
+                throw std::runtime_error{"unexpected end of archive"};
+            } else {
+                count -= moved;
+            }
+        }
+
+        while (count > 0 && canSendfile) {
+            ssize_t moved = sendfile(out, in, nullptr, std::min(count, chunk));
+            if (moved == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EINVAL && errno != ENOSYS) {
+                    throw std::runtime_error{std::string{"sendfile: "} + strerror(errno)};
+                }
+                canSendfile = false;
+            } else if (moved == 0) {
+                throw std::runtime_error{"unexpected end of archive"};
+            } else {
+                count -= moved;
+            }
+        }
+#endif
+    }
+};
+
+static bool startsWithMachOMagic(ArchiveStream &stream, uint64_t size) {
+    if (size < sizeof(uint32_t) || stream.fill(sizeof(uint32_t)) < sizeof(uint32_t)) {
+        return false;
+    }
+    uint32_t magic;
+    memcpy(&magic, stream.peek(), sizeof(magic));
+    return isMachOMagic(magic);
+}
+
+// Hand a Mach-O entry of the given size to the handler, and write it out
+static void filterEntry(ArchiveStream &stream, const std::string &path, uint64_t size,
+                        const MachOEntryHandler &handler) {
+    std::string contents = stream.read(size);
+    handler(path, contents);
+    if (contents.size() != size) {
+        throw std::runtime_error{"rewritten entry changed size: " + path};
+    }
+    stream.write(contents);
+}
+
+// NAR, as produced by `nix-store --dump`: a tree of length-prefixed strings,
+// each padded to a multiple of 8 bytes.
+class NARFilter {
+public:
+    NARFilter(ArchiveStream &stream, const MachOEntryHandler &handler) : stream(stream), handler(handler) {}
+
+    void run() {
+        expect("nix-archive-1");
+        node("");
+        stream.copyRest();
+    }
+
+private:
+    // Tokens and names are short; anything longer is not a NAR
+    static constexpr const uint64_t maxStringLength = 64 * 1024;
+
+    ArchiveStream &stream;
+    const MachOEntryHandler &handler;
+
+    static uint64_t padding(uint64_t length) {
+        return (8 - length % 8) % 8;
+    }
+
+    uint64_t length() {
+        std::string bytes = stream.read(sizeof(uint64_t));
+        stream.write(bytes);
+
+        uint64_t value = 0;
+        for (int i = sizeof(uint64_t) - 1; i >= 0; i--) {
+            value = (value << 8) | static_cast<unsigned char>(bytes[i]);
+        }
+        return value;
+    }
+
+    std::string string() {
+        uint64_t len = length();
+        if (len > maxStringLength) {
+            throw std::runtime_error{"malformed NAR: string of " + std::to_string(len) + " bytes"};
+        }
+        std::string bytes = stream.read(len + padding(len));
+        stream.write(bytes);
+        return bytes.substr(0, len);
+    }
+
+    void expect(const std::string &token) {
+        std::string actual = string();
+        if (actual != token) {
+            throw std::runtime_error{"malformed NAR: expected '" + token + "', got '" + actual + "'"};
+        }
+    }
+
+    void node(const std::string &path) {
+        expect("(");
+        expect("type");
+        std::string type = string();
+
+        if (type == "regular") {
+            std::string token = string();
+            if (token == "executable") {
+                expect("");
+                token = string();
+            }
+            if (token != "contents") {
+                throw std::runtime_error{"malformed NAR: expected 'contents', got '" + token + "'"};
+            }
+            contents(path);
+            expect(")");
+        } else if (type == "symlink") {
+            expect("target");
+            string();
+            expect(")");
+        } else if (type == "directory") {
+            for (;;) {
+                std::string token = string();
+                if (token == ")") {
+                    break;
+                }
+                if (token != "entry") {
+                    throw std::runtime_error{"malformed NAR: expected 'entry', got '" + token + "'"};
+                }
+                expect("(");
+                expect("name");
+                std::string name = string();
+                expect("node");
+                node(path.empty() ? name : path + "/" + name);
+                expect(")");
+            }
+        } else {
+            throw std::runtime_error{"malformed NAR: unknown node type '" + type + "'"};
+        }
+    }
+
+    void contents(const std::string &path) {
+        uint64_t size = length();
+        if (startsWithMachOMagic(stream, size)) {
+            filterEntry(stream, path, size, handler);
+            stream.copy(padding(size));
+        } else {
+            stream.copy(size + padding(size));
+        }
+    }
+};
+
+// POSIX ustar, including the pax and GNU extensions for long names
+class TarFilter {
+public:
+    TarFilter(ArchiveStream &stream, const MachOEntryHandler &handler) : stream(stream), handler(handler) {}
+
+    void run() {
+        for (;;) {
+            if (stream.fill(blockSize) == 0) {
+                // Archive without end-of-archive blocks
+                return;
+            }
+            std::string header = stream.read(blockSize);
+            stream.write(header);
+
+            if (std::all_of(header.begin(), header.end(), [](char c) { return c == '\0'; })) {
+                stream.copyRest();
+                return;
+            }
+            if (!checksumMatches(header)) {
+                throw std::runtime_error{"malformed tar: header checksum mismatch"};
+            }
+
+            uint64_t size = number(header, 124, 12);
+            if (paxSize) {
+                size = pendingSize;
+            }
+            uint64_t padded = (size + blockSize - 1) / blockSize * blockSize;
+
+            char type = header[156];
+            switch (type) {
+                case 'L': {
+                    // GNU long name for the next entry
+                    std::string data = extension(padded);
+                    pendingPath = data.substr(0, std::min<size_t>(size, strnlen(data.c_str(), data.size())));
+                    break;
+                }
+                case 'x':
+                    // pax extended header for the next entry
+                    parsePax(extension(padded).substr(0, size));
+                    break;
+                case '0':
+                case '\0':
+                case '7': {
+                    std::string path = pendingPath.empty() ? name(header) : pendingPath;
+                    if (startsWithMachOMagic(stream, size)) {
+                        filterEntry(stream, path, size, handler);
+                        stream.copy(padded - size);
+                    } else {
+                        stream.copy(padded);
+                    }
+                    reset();
+                    break;
+                }
+                default:
+                    // Links, directories and global headers carry nothing to sign
+                    stream.copy(padded);
+                    if (type != 'g') {
+                        reset();
+                    }
+            }
+        }
+    }
+
+private:
+    static constexpr const uint64_t blockSize = 512;
+    // Extended headers are read whole, so keep them to a sensible size
+    static constexpr const uint64_t maxExtensionSize = 1024 * 1024;
+
+    ArchiveStream &stream;
+    const MachOEntryHandler &handler;
+
+    // Overrides for the next entry from extension headers
+    std::string pendingPath;
+    uint64_t pendingSize = 0;
+    bool paxSize = false;
+
+    void reset() {
+        pendingPath.clear();
+        paxSize = false;
+    }
+
+    std::string extension(uint64_t padded) {
+        if (padded > maxExtensionSize) {
+            throw std::runtime_error{"malformed tar: extension header of " + std::to_string(padded) + " bytes"};
+        }
+        std::string data = stream.read(padded);
+        stream.write(data);
+        return data;
+    }
+
+    // Records are "<length> <key>=<value>\n", the length covering the whole record
+    void parsePax(const std::string &data) {
+        size_t offset = 0;
+        while (offset < data.size()) {
+            size_t space = data.find(' ', offset);
+            if (space == std::string::npos) {
+                break;
+            }
+            size_t length = std::strtoul(data.c_str() + offset, nullptr, 10);
+            if (length == 0 || offset + length > data.size()) {
+                break;
+            }
+            std::string record = data.substr(space + 1, offset + length - space - 2);
+            size_t equals = record.find('=');
+            if (equals != std::string::npos) {
+                std::string key = record.substr(0, equals);
+                std::string value = record.substr(equals + 1);
+                if (key == "path") {
+                    pendingPath = value;
+                } else if (key == "size") {
+                    pendingSize = std::strtoull(value.c_str(), nullptr, 10);
+                    paxSize = true;
+                }
+            }
+            offset += length;
+        }
+    }
+
+    static bool checksumMatches(const std::string &header) {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < blockSize; i++) {
+            // The checksum field itself counts as spaces
+            sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(header[i]);
+        }
+        return sum == number(header, 148, 8);
+    }
+
+    // Octal, or base-256 when the high bit of the first byte is set
+    static uint64_t number(const std::string &header, size_t offset, size_t length) {
+        uint64_t value = 0;
+        if (static_cast<unsigned char>(header[offset]) & 0x80) {
+            for (size_t i = 0; i < length; i++) {
+                unsigned char byte = header[offset + i];
+                value = (value << 8) | (i == 0 ? byte & 0x7f : byte);
+            }
+            return value;
+        }
+        for (size_t i = 0; i < length; i++) {
+            char c = header[offset + i];
+            if (c >= '0' && c <= '7') {
+                value = value * 8 + (c - '0');
+            } else if (c != ' ' || value != 0) {
+                break;
+            }
+        }
+        return value;
+    }
+
+    static std::string field(const std::string &header, size_t offset, size_t length) {
+        return std::string{header.c_str() + offset, strnlen(header.c_str() + offset, length)};
+    }
+
+    static std::string name(const std::string &header) {
+        std::string name = field(header, 0, 100);
+        if (header.compare(257, 5, "ustar") == 0) {
+            std::string prefix = field(header, 345, 155);
+            if (!prefix.empty()) {
+                name = prefix + "/" + name;
+            }
+        }
+        return name;
+    }
+};
+
+static Commands::ArchiveFormat detectFormat(ArchiveStream &stream) {
+    static const char narMagic[] = "\x0d\0\0\0\0\0\0\0nix-archive-1";
+    if (stream.fill(sizeof(narMagic) - 1) >= sizeof(narMagic) - 1 &&
+        memcmp(stream.peek(), narMagic, sizeof(narMagic) - 1) == 0) {
+        return Commands::ArchiveFormat::NAR;
+    }
+    if (stream.fill(262) >= 262 && memcmp(stream.peek() + 257, "ustar", 5) == 0) {
+        return Commands::ArchiveFormat::Tar;
+    }
+    throw std::runtime_error{"input is neither a NAR nor a ustar archive"};
+}
+
+void filterArchive(int in, int out, Commands::ArchiveFormat format, const MachOEntryHandler &handler) {
+    ArchiveStream stream{in, out};
+
+    if (format == Commands::ArchiveFormat::Auto) {
+        format = detectFormat(stream);
+    }
+
+    if (format == Commands::ArchiveFormat::NAR) {
+        NARFilter{stream, handler}.run();
+    } else {
+        TarFilter{stream, handler}.run();
+    }
+}
+};
@@ -0,0 +1,59 @@
+#ifndef SIGTOOL_ARCHIVE_H
+#define SIGTOOL_ARCHIVE_H
+
+#include <functional>
+#include <istream>
+#include <streambuf>
+#include <string>
+
+#include "commands.h"
+
+namespace SigTool {
+
+// Called with the path and complete contents of each regular file in an
+// archive whose contents start with a Mach-O magic. The contents may be
+// rewritten in place, but must keep their size so that the archive framing
+// stays valid.
+using MachOEntryHandler = std::function<void(const std::string &path, std::string &contents)>;
+
+// Copy a NAR or tar archive from one descriptor to another, passing its
+// Mach-O entries through the handler. Only those entries are held in
+// memory; everything else is copied through as it is read, without
+// entering user space where the descriptors allow it.
+void filterArchive(int in, int out, Commands::ArchiveFormat format, const MachOEntryHandler &handler);
+
+// A seekable input stream over bytes held elsewhere, without copying them
+class MemoryStream : public std::istream {
+public:
+    MemoryStream(const char *data, size_t size) : std::istream(&buf), buf(data, size) {}
+
+private:
+    class Buffer : public std::streambuf {
+    public:
+        Buffer(const char *data, size_t size) {
+            char *begin = const_cast<char *>(data);
+            setg(begin, begin, begin + size);
+        }
+
+    protected:
+        pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+            off_type base = dir == std::ios_base::beg ? 0
+                          : dir == std::ios_base::cur ? gptr() - eback()
+                          : egptr() - eback();
+            return seekpos(base + off, which);
+        }
+
+        pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+            if (!(which & std::ios_base::in) || pos < 0 || pos > egptr() - eback()) {
+                return pos_type(off_type(-1));
+            }
+            setg(eback(), eback() + off_type(pos), egptr());
+            return pos;
+        }
+    };
+
+    Buffer buf;
+};
+};
+
+#endif // SIGTOOL_ARCHIVE_H
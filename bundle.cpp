@@ -0,0 +1,580 @@
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "cdhash.h"
+#include "commands.h"
+#include "hash.h"
+#include "macho.h"
+#include "signature.h"
+#include "signer.h"
+#include "workers.h"
+
+namespace SigTool {
+
+// Resource rules, as evaluated and as recorded in CodeResources. A path is
+// governed by the matching rule of highest weight, and is not sealed if no
+// rule matches or that rule omits it.
+struct ResourceRule {
+    const char *pattern;
+    unsigned int weight;
+    bool omit;
+    bool optional;
+    bool nested;
+};
+
+static const std::vector<ResourceRule> deepRules{
+        {"^Resources/",                             1,    false, false, false},
+        {"^Resources/.*\\.lproj/",                  1000, false, true,  false},
+        {"^Resources/.*\\.lproj/locversion.plist$", 1100, true,  false, false},
+        {"^Resources/Base\\.lproj/",                1010, false, false, false},
+        {"^version.plist$",                         1,    false, false, false},
+};
+
+static const std::vector<ResourceRule> deepRules2{
+        {".*\\.dSYM($|/)",                          11,   false, false, false},
+        {"^(.*/)?\\.DS_Store$",                     2000, true,  false, false},
+        {"^(Frameworks|SharedFrameworks|PlugIns|Plug-ins|XPCServices|Helpers|MacOS|Library/(Automator|Spotlight|LoginItems))/",
+                                                    10,   false, false, true},
+        {"^.*",                                     1,    false, false, false},
+        {"^Info\\.plist$",                          20,   true,  false, false},
+        {"^PkgInfo$",                               20,   true,  false, false},
+        {"^Resources/",                             20,   false, false, false},
+        {"^Resources/.*\\.lproj/",                  1000, false, true,  false},
+        {"^Resources/.*\\.lproj/locversion.plist$", 1100, true,  false, false},
+        {"^Resources/Base\\.lproj/",                1010, false, false, false},
+        {"^[^/]+$",                                 10,   false, false, true},
+        {"^embedded\\.provisionprofile$",           20,   false, false, false},
+        {"^version\\.plist$",                       20,   false, false, false},
+};
+
+static const std::vector<ResourceRule> shallowRules{
+        {"^.*",                          1,    false, false, false},
+        {"^.*\\.lproj/",                 1000, false, true,  false},
+        {"^.*\\.lproj/locversion.plist$", 1100, true,  false, false},
+        {"^Base\\.lproj/",               1010, false, false, false},
+        {"^version.plist$",              1,    false, false, false},
+};
+
+static const std::vector<ResourceRule> shallowRules2{
+        {".*\\.dSYM($|/)",                11,   false, false, false},
+        {"^(.*/)?\\.DS_Store$",           2000, true,  false, false},
+        {"^.*",                          1,    false, false, false},
+        {"^.*\\.lproj/",                 1000, false, true,  false},
+        {"^.*\\.lproj/locversion.plist$", 1100, true,  false, false},
+        {"^Base\\.lproj/",               1010, false, false, false},
+        {"^Info\\.plist$",               20,   true,  false, false},
+        {"^PkgInfo$",                    20,   true,  false, false},
+        {"^embedded\\.provisionprofile$", 20,   false, false, false},
+        {"^version\\.plist$",            20,   false, false, false},
+};
+
+class RuleSet {
+public:
+    explicit RuleSet(const std::vector<ResourceRule> &rules) : rules(rules) {
+        for (const auto &rule : rules) {
+            expressions.emplace_back(rule.pattern, std::regex::ECMAScript | std::regex::optimize);
+        }
+    }
+
+    // The governing rule, or nullptr when the path is not sealed
+    const ResourceRule *match(const std::string &path) const {
+        const ResourceRule *best = nullptr;
+        for (size_t i = 0; i < rules.size(); i++) {
+            if ((!best || rules[i].weight >= best->weight) && std::regex_search(path, expressions[i])) {
+                best = &rules[i];
+            }
+        }
+        return (best && !best->omit) ? best : nullptr;
+    }
+
+    const std::vector<ResourceRule> &rules;
+
+private:
+    std::vector<std::regex> expressions;
+};
+
+static const char *nestedBundleExtensions[] = {
+        ".app", ".framework", ".appex", ".xpc", ".bundle", ".plugin", ".kext", ".systemextension",
+};
+
+static bool endsWith(const std::string &s, const std::string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool isNestedBundleName(const std::string &name) {
+    for (const char *extension : nestedBundleExtensions) {
+        if (endsWith(name, extension)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool exists(const std::string &path, bool directory = false) {
+    struct stat st{};
+    return stat(path.c_str(), &st) == 0 && (!directory || S_ISDIR(st.st_mode));
+}
+
+// Only XML property lists are understood, others yield an empty string
+static std::string plistString(const std::string &plist, const std::string &key) {
+    std::string keyElement = "<key>" + key + "</key>";
+    auto keyPos = plist.find(keyElement);
+    if (keyPos == std::string::npos) {
+        return std::string{};
+    }
+
+    auto start = plist.find("<string>", keyPos + keyElement.size());
+    auto end = plist.find("</string>", start);
+    if (start == std::string::npos || end == std::string::npos) {
+        return std::string{};
+    }
+
+    start += strlen("<string>");
+    return plist.substr(start, end - start);
+}
+
+static std::string base64(const char *data, size_t len) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < len; i += 3) {
+        uint32_t chunk = (uint8_t)data[i] << 16;
+        if (i + 1 < len) chunk |= (uint8_t)data[i + 1] << 8;
+        if (i + 2 < len) chunk |= (uint8_t)data[i + 2];
+        out.push_back(alphabet[(chunk >> 18) & 0x3f]);
+        out.push_back(alphabet[(chunk >> 12) & 0x3f]);
+        out.push_back(i + 1 < len ? alphabet[(chunk >> 6) & 0x3f] : '=');
+        out.push_back(i + 2 < len ? alphabet[chunk & 0x3f] : '=');
+    }
+    return out;
+}
+
+static std::string xmlEscape(const std::string &s) {
+    std::string out;
+    for (char c : s) {
+        switch (c) {
+            case '&': out += "&amp;"; break;
+            case '<': out += "&lt;"; break;
+            case '>': out += "&gt;"; break;
+            default: out.push_back(c);
+        }
+    }
+    return out;
+}
+
+// The cdhash of the first slice of a signed file
+static CDHash cdhashOf(const std::string &filename) {
+    MachOList list{filename};
+    std::ifstream f{filename, std::ifstream::in | std::ifstream::binary};
+    std::string signature = list.machos.front()->readCodeSignatureData(f);
+    std::string codeDirectory = SuperBlob::blobBytes(signature, CSSLOT_CODEDIRECTORY);
+    if (codeDirectory.empty()) {
+        throw std::runtime_error{filename + " has no code directory"};
+    }
+    return CDHash{Hash{codeDirectory}};
+}
+
+// How a sealed path appears in CodeResources
+struct SealedEntry {
+    enum { File, Nested, Symlink } kind;
+    bool inFiles;
+    bool inFiles2;
+    bool optional;
+    SHA1Hash sha1;
+    Hash sha256;
+    CDHash cdhash;
+    std::string symlink;
+};
+
+struct BundleNode {
+    std::string path;
+    // Resources are sealed relative to this directory
+    std::string root;
+    std::string infoPlist;
+    std::string executable;
+    std::string identifier;
+    bool shallow = false;
+
+    BundleNode *parent = nullptr;
+    std::vector<std::shared_ptr<BundleNode>> children;
+    std::atomic<unsigned int> pendingChildren{0};
+    std::atomic<unsigned int> pendingFiles{0};
+
+    // Relative paths of regular files and symlinks, in discovery order
+    std::vector<std::string> files;
+
+    std::mutex mutex;
+    std::map<std::string, SealedEntry> sealed;
+};
+
+static void discoverContents(BundleNode &node, const std::string &relative);
+
+static std::shared_ptr<BundleNode> discoverBundle(const std::string &path, const std::string &identifier) {
+    auto node = std::make_shared<BundleNode>();
+    node->path = path;
+
+    if (exists(path + "/Contents", true)) {
+        node->root = path + "/Contents";
+        node->infoPlist = node->root + "/Info.plist";
+    } else if (exists(path + "/Versions/Current", true)) {
+        node->root = path + "/Versions/Current";
+        node->infoPlist = node->root + "/Resources/Info.plist";
+    } else {
+        node->root = path;
+        node->infoPlist = node->root + "/Info.plist";
+        node->shallow = true;
+    }
+
+    std::string plist;
+    if (exists(node->infoPlist)) {
+        plist = readFile(node->infoPlist);
+    } else {
+        node->infoPlist.clear();
+    }
+
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    std::string executableName = plistString(plist, "CFBundleExecutable");
+    if (executableName.empty()) {
+        executableName = name.substr(0, name.find_last_of('.'));
+    }
+
+    for (const std::string &candidate : {node->root + "/MacOS/" + executableName, node->root + "/" + executableName}) {
+        if (exists(candidate)) {
+            node->executable = candidate;
+            break;
+        }
+    }
+
+    node->identifier = identifier;
+    if (node->identifier.empty()) {
+        node->identifier = plistString(plist, "CFBundleIdentifier");
+    }
+    if (node->identifier.empty()) {
+        node->identifier = executableName;
+    }
+
+    discoverContents(*node, "");
+    return node;
+}
+
+static void discoverContents(BundleNode &node, const std::string &relative) {
+    std::string directory = relative.empty() ? node.root : node.root + "/" + relative;
+
+    DIR *dir = opendir(directory.c_str());
+    if (!dir) {
+        throw std::runtime_error{"opening directory " + directory + ": " + strerror(errno)};
+    }
+
+    std::vector<std::string> names;
+    while (struct dirent *entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name != "." && name != "..") {
+            names.push_back(name);
+        }
+    }
+    closedir(dir);
+
+    for (const auto &name : names) {
+        std::string childRelative = relative.empty() ? name : relative + "/" + name;
+        std::string childPath = node.root + "/" + childRelative;
+
+        if (relative.empty() && name == "_CodeSignature") {
+            continue;
+        }
+        if (childPath == node.executable) {
+            continue;
+        }
+
+        struct stat st{};
+        if (lstat(childPath.c_str(), &st) != 0) {
+            throw std::runtime_error{"stat of " + childPath + " failed: " + strerror(errno)};
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (isNestedBundleName(name)) {
+                auto child = discoverBundle(childPath, "");
+                // Bundles without code are sealed as plain resources
+                if (!child->executable.empty()) {
+                    child->parent = &node;
+                    node.children.push_back(child);
+                    continue;
+                }
+            }
+            discoverContents(node, childRelative);
+        } else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
+            node.files.push_back(childRelative);
+        }
+    }
+}
+
+class BundleSigner {
+public:
+    BundleSigner(const Commands::CodesignOptions &options, WorkerPool &pool)
+            : options(options), group(pool),
+              deepRuleSet(deepRules), deepRuleSet2(deepRules2),
+              shallowRuleSet(shallowRules), shallowRuleSet2(shallowRules2) {}
+
+    void sign(const std::shared_ptr<BundleNode> &root) {
+        scheduleLeaves(*root);
+        group.wait();
+    }
+
+private:
+    const Commands::CodesignOptions &options;
+    TaskGroup group;
+    RuleSet deepRuleSet, deepRuleSet2, shallowRuleSet, shallowRuleSet2;
+
+    void scheduleLeaves(BundleNode &node) {
+        node.pendingChildren = node.children.size();
+        if (node.children.empty()) {
+            group.submit([this, &node] { sealFiles(node); });
+        }
+        for (const auto &child : node.children) {
+            scheduleLeaves(*child);
+        }
+    }
+
+    // Hash or sign each file of the bundle concurrently; the last to finish
+    // moves the bundle on to sealing.
+    void sealFiles(BundleNode &node) {
+        node.pendingFiles = node.files.size() + 1;
+        for (const auto &file : node.files) {
+            group.submit([this, &node, &file] {
+                sealFile(node, file);
+                fileDone(node);
+            });
+        }
+        fileDone(node);
+    }
+
+    void fileDone(BundleNode &node) {
+        if (--node.pendingFiles == 0) {
+            group.submit([this, &node] { finish(node); });
+        }
+    }
+
+    void sealFile(BundleNode &node, const std::string &relative) {
+        const RuleSet &v1 = node.shallow ? shallowRuleSet : deepRuleSet;
+        const RuleSet &v2 = node.shallow ? shallowRuleSet2 : deepRuleSet2;
+        const ResourceRule *rule1 = v1.match(relative);
+        const ResourceRule *rule2 = v2.match(relative);
+        if (!rule1 && !rule2) {
+            return;
+        }
+
+        std::string path = node.root + "/" + relative;
+
+        SealedEntry entry{};
+        entry.inFiles = rule1 != nullptr;
+        entry.inFiles2 = rule2 != nullptr;
+        entry.optional = (rule1 && rule1->optional) || (rule2 && rule2->optional);
+
+        struct stat st{};
+        if (lstat(path.c_str(), &st) != 0) {
+            throw std::runtime_error{"stat of " + path + " failed: " + strerror(errno)};
+        }
+
+        if (S_ISLNK(st.st_mode)) {
+            char target[PATH_MAX];
+            ssize_t len = readlink(path.c_str(), target, sizeof(target));
+            if (len < 0) {
+                throw std::runtime_error{"readlink " + path + ": " + strerror(errno)};
+            }
+            entry.kind = SealedEntry::Symlink;
+            entry.symlink = std::string(target, len);
+            entry.sha1 = SHA1Hash{target, (size_t) len};
+        } else if (rule2 && rule2->nested && Commands::checkRequiresSignature(path) == 0) {
+            Commands::CodesignOptions nestedOptions = options;
+            nestedOptions.identifier.clear();
+            nestedOptions.entitlements.clear();
+            nestedOptions.infoPlist.clear();
+            nestedOptions.resources.clear();
+            nestedOptions.force = true;
+            Commands::codesign(nestedOptions, path);
+
+            entry.kind = SealedEntry::Nested;
+            entry.cdhash = cdhashOf(path);
+            hashFile(path, entry);
+        } else {
+            entry.kind = SealedEntry::File;
+            hashFile(path, entry);
+        }
+
+        std::lock_guard<std::mutex> lock{node.mutex};
+        node.sealed[relative] = entry;
+    }
+
+    static void hashFile(const std::string &path, SealedEntry &entry) {
+        std::ifstream in{path, std::ifstream::in | std::ifstream::binary};
+        if (!in.is_open()) {
+            throw std::runtime_error{"Failed opening file for read: '" + path + "' :" + strerror(errno)};
+        }
+
+        Hasher<SHA1Hash> sha1;
+        Hasher<SHA256Hash> sha256;
+        std::vector<char> buf(1 << 20);
+        while (in) {
+            in.read(buf.data(), buf.size());
+            sha1.update(buf.data(), in.gcount());
+            sha256.update(buf.data(), in.gcount());
+        }
+        if (in.bad()) {
+            throw std::runtime_error{"reading " + path + ": " + strerror(errno)};
+        }
+
+        entry.sha1 = sha1.finish();
+        entry.sha256 = sha256.finish();
+    }
+
+    void finish(BundleNode &node) {
+        for (const auto &child : node.children) {
+            SealedEntry entry{};
+            entry.kind = SealedEntry::Nested;
+            entry.inFiles2 = true;
+            entry.cdhash = cdhashOf(child->executable);
+            node.sealed[child->path.substr(node.root.size() + 1)] = entry;
+        }
+
+        std::string signatureDir = node.root + "/_CodeSignature";
+        if (mkdir(signatureDir.c_str(), 0755) != 0 && errno != EEXIST) {
+            throw std::runtime_error{"creating " + signatureDir + ": " + strerror(errno)};
+        }
+
+        std::string codeResources = signatureDir + "/CodeResources";
+        std::ofstream out{codeResources, std::ofstream::out | std::ofstream::trunc};
+        writeCodeResources(out, node);
+        out.close();
+        if (out.fail()) {
+            throw std::runtime_error{"writing " + codeResources + ": " + strerror(errno)};
+        }
+
+        if (node.executable.empty()) {
+            throw std::runtime_error{"bundle has no main executable: " + node.path};
+        }
+
+        Commands::CodesignOptions executableOptions = options;
+        executableOptions.identifier = node.identifier;
+        executableOptions.infoPlist = node.infoPlist;
+        executableOptions.resources = codeResources;
+        executableOptions.force = true;
+        if (node.parent) {
+            // Entitlements are only for the outermost bundle
+            executableOptions.entitlements.clear();
+        }
+        Commands::codesign(executableOptions, node.executable);
+
+        if (node.parent && --node.parent->pendingChildren == 0) {
+            BundleNode &parent = *node.parent;
+            group.submit([this, &parent] { sealFiles(parent); });
+        }
+    }
+
+    static void writeRules(std::ostream &os, const char *key, const std::vector<ResourceRule> &rules) {
+        std::map<std::string, const ResourceRule *> sorted;
+        for (const auto &rule : rules) {
+            sorted[rule.pattern] = &rule;
+        }
+
+        os << "\t<key>" << key << "</key>\n\t<dict>\n";
+        for (const auto &item : sorted) {
+            const ResourceRule &rule = *item.second;
+            os << "\t\t<key>" << xmlEscape(item.first) << "</key>\n";
+            if (!rule.omit && !rule.optional && !rule.nested && rule.weight == 1) {
+                os << "\t\t<true/>\n";
+                continue;
+            }
+            os << "\t\t<dict>\n";
+            if (rule.nested) os << "\t\t\t<key>nested</key>\n\t\t\t<true/>\n";
+            if (rule.omit) os << "\t\t\t<key>omit</key>\n\t\t\t<true/>\n";
+            if (rule.optional) os << "\t\t\t<key>optional</key>\n\t\t\t<true/>\n";
+            os << "\t\t\t<key>weight</key>\n\t\t\t<real>" << rule.weight << "</real>\n";
+            os << "\t\t</dict>\n";
+        }
+        os << "\t</dict>\n";
+    }
+
+    void writeCodeResources(std::ostream &os, const BundleNode &node) const {
+        os << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+              "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" "
+              "\"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+              "<plist version=\"1.0\">\n<dict>\n";
+
+        os << "\t<key>files</key>\n\t<dict>\n";
+        for (const auto &item : node.sealed) {
+            const SealedEntry &entry = item.second;
+            if (!entry.inFiles) {
+                continue;
+            }
+            os << "\t\t<key>" << xmlEscape(item.first) << "</key>\n";
+            std::string data = "<data>" + base64(entry.sha1.bytes, sizeof(entry.sha1.bytes)) + "</data>";
+            if (entry.optional) {
+                os << "\t\t<dict>\n\t\t\t<key>hash</key>\n\t\t\t" << data
+                   << "\n\t\t\t<key>optional</key>\n\t\t\t<true/>\n\t\t</dict>\n";
+            } else {
+                os << "\t\t" << data << "\n";
+            }
+        }
+        os << "\t</dict>\n";
+
+        os << "\t<key>files2</key>\n\t<dict>\n";
+        for (const auto &item : node.sealed) {
+            const SealedEntry &entry = item.second;
+            if (!entry.inFiles2) {
+                continue;
+            }
+            os << "\t\t<key>" << xmlEscape(item.first) << "</key>\n\t\t<dict>\n";
+            switch (entry.kind) {
+                case SealedEntry::Nested:
+                    os << "\t\t\t<key>cdhash</key>\n\t\t\t<data>" << base64(entry.cdhash.bytes, CDHash::size)
+                       << "</data>\n\t\t\t<key>requirement</key>\n\t\t\t<string>cdhash H&quot;"
+                       << entry.cdhash.hex() << "&quot;</string>\n";
+                    break;
+                case SealedEntry::Symlink:
+                    os << "\t\t\t<key>symlink</key>\n\t\t\t<string>" << xmlEscape(entry.symlink) << "</string>\n";
+                    break;
+                case SealedEntry::File:
+                    os << "\t\t\t<key>hash</key>\n\t\t\t<data>" << base64(entry.sha1.bytes, sizeof(entry.sha1.bytes))
+                       << "</data>\n\t\t\t<key>hash2</key>\n\t\t\t<data>"
+                       << base64(entry.sha256.bytes, sizeof(entry.sha256.bytes)) << "</data>\n";
+                    if (entry.optional) {
+                        os << "\t\t\t<key>optional</key>\n\t\t\t<true/>\n";
+                    }
+                    break;
+            }
+            os << "\t\t</dict>\n";
+        }
+        os << "\t</dict>\n";
+
+        writeRules(os, "rules", node.shallow ? shallowRules : deepRules);
+        writeRules(os, "rules2", node.shallow ? shallowRules2 : deepRules2);
+
+        os << "</dict>\n</plist>\n";
+    }
+};
+
+int Commands::codesignBundle(const CodesignOptions &options, const std::string &bundle) {
+    std::string path = bundle;
+    while (path.size() > 1 && path.back() == '/') {
+        path.pop_back();
+    }
+
+    auto root = discoverBundle(path, options.identifier);
+
+    WorkerPool pool{options.jobs};
+    BundleSigner signer{options, pool};
+    signer.sign(root);
+
+    return 0;
+}
+};
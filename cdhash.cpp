@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#include "cdhash.h"
+#include "emit.h"
+#include "macho.h"
+
+namespace SigTool {
+
+CDHash::CDHash(const Hash &codeDirectoryHash) {
+    memcpy(bytes, codeDirectoryHash.bytes, size);
+}
+
+CDHash CDHash::fromHex(const std::string &hex) {
+    if (hex.size() != 2 * size || hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos) {
+        throw std::runtime_error{"not a cdhash: " + hex};
+    }
+
+    CDHash cdhash{};
+    for (int i = 0; i < size; i++) {
+        cdhash.bytes[i] = static_cast<char>(std::stoul(hex.substr(2 * i, 2), nullptr, 16));
+    }
+    return cdhash;
+}
+
+std::string CDHash::hex() const {
+    return toHex(bytes, size);
+}
+
+// Read length bytes at offset within the signature region, which must hold them
+static std::string readSignatureRange(std::istream &f, const std::shared_ptr<MachO> &macho,
+                                      uint64_t offset, uint64_t length) {
+    auto codeSignature = macho->getCodeSignatureLoadCommand();
+    if (offset + length > codeSignature->data.dataSize) {
+        throw std::runtime_error{"truncated signature"};
+    }
+
+    std::string bytes(length, '\0');
+    f.seekg(macho->offset + codeSignature->data.dataOff + offset);
+    f.read(&bytes[0], length);
+    if (f.fail()) {
+        throw std::runtime_error{std::string{"reading code signature: "} + strerror(errno)};
+    }
+    return bytes;
+}
+
+std::vector<CDHashEntry> readCDHashes(const std::string &filename) {
+    MachOList list{filename};
+
+    std::ifstream f;
+    f.open(filename, std::ifstream::in | std::ifstream::binary);
+    if (f.fail()) {
+        throw std::runtime_error(std::string{"opening input file: "} + strerror(errno));
+    }
+
+    std::vector<CDHashEntry> entries;
+    for (const auto &macho : list.machos) {
+        if (!macho->getCodeSignatureLoadCommand()) {
+            continue;
+        }
+
+        // The superblob header and index, then the code directory alone
+        std::istringstream header{readSignatureRange(f, macho, 0, 3 * sizeof(uint32_t))};
+        if (ReadBE::readUInt32(header) != CSMAGIC_EMBEDDED_SIGNATURE) {
+            throw std::runtime_error{filename + ": not an embedded signature"};
+        }
+        ReadBE::readUInt32(header); // length
+        uint32_t count = ReadBE::readUInt32(header);
+
+        std::istringstream index{readSignatureRange(f, macho, 3 * sizeof(uint32_t),
+                                                    2 * sizeof(uint32_t) * (uint64_t) count)};
+        std::string codeDirectory;
+        for (uint32_t i = 0; i < count && codeDirectory.empty(); i++) {
+            uint32_t slot = ReadBE::readUInt32(index);
+            uint32_t offset = ReadBE::readUInt32(index);
+            if (slot != CSSLOT_CODEDIRECTORY) {
+                continue;
+            }
+
+            std::istringstream blobHeader{readSignatureRange(f, macho, offset, 2 * sizeof(uint32_t))};
+            if (ReadBE::readUInt32(blobHeader) != CSMAGIC_CODEDIRECTORY) {
+                throw std::runtime_error{filename + ": malformed code directory"};
+            }
+            codeDirectory = readSignatureRange(f, macho, offset, ReadBE::readUInt32(blobHeader));
+        }
+        if (codeDirectory.empty()) {
+            throw std::runtime_error{filename + " has no code directory"};
+        }
+
+        entries.push_back(CDHashEntry{CDHash{Hash{codeDirectory}}, macho->header.cpuType,
+                                      macho->header.cpuSubType, filename});
+    }
+
+    return entries;
+}
+
+static void sortEntries(std::vector<CDHashEntry> &entries) {
+    std::sort(entries.begin(), entries.end(), [](const CDHashEntry &a, const CDHashEntry &b) {
+        if (!(a.cdhash == b.cdhash)) {
+            return a.cdhash < b.cdhash;
+        }
+        return a.path < b.path;
+    });
+}
+
+void CDHashIndex::emit(std::ostream &os, std::vector<CDHashEntry> entries) {
+    sortEntries(entries);
+
+    EmitBE::writeUInt32(os, magic);
+    EmitBE::writeUInt32(os, version);
+    EmitBE::writeUInt32(os, entries.size());
+    EmitBE::writeUInt32(os, headerSize + recordSize * entries.size());
+
+    // Each distinct path is stored once
+    std::string paths;
+    std::map<std::string, uint32_t> pathOffsets;
+    for (const auto &entry : entries) {
+        auto inserted = pathOffsets.emplace(entry.path, paths.size());
+        if (inserted.second) {
+            paths += entry.path;
+            paths.push_back('\0');
+        }
+
+        os.write(entry.cdhash.bytes, CDHash::size);
+        EmitBE::writeUInt32(os, entry.cpuType);
+        EmitBE::writeUInt32(os, entry.cpuSubType);
+        EmitBE::writeUInt32(os, inserted.first->second);
+    }
+    os.write(paths.data(), paths.size());
+}
+
+void CDHashIndex::emitText(std::ostream &os, std::vector<CDHashEntry> entries) {
+    sortEntries(entries);
+    for (const auto &entry : entries) {
+        os << entry.cdhash.hex() << " " << cpuTypeName(entry.cpuType, entry.cpuSubType) << " " << entry.path << "\n";
+    }
+}
+
+static CDHashEntry readRecord(std::istream &index, uint32_t pathsOffset, uint32_t record) {
+    index.seekg(CDHashIndex::headerSize + (uint64_t) record * CDHashIndex::recordSize);
+
+    CDHashEntry entry{};
+    index.read(entry.cdhash.bytes, CDHash::size);
+    entry.cpuType = ReadBE::readUInt32(index);
+    entry.cpuSubType = ReadBE::readUInt32(index);
+    uint32_t pathOffset = ReadBE::readUInt32(index);
+    if (index.fail()) {
+        throw std::runtime_error{"truncated cdhash index"};
+    }
+
+    index.seekg((uint64_t) pathsOffset + pathOffset);
+    std::getline(index, entry.path, '\0');
+    if (index.fail()) {
+        throw std::runtime_error{"truncated cdhash index"};
+    }
+    return entry;
+}
+
+std::vector<CDHashEntry> CDHashIndex::lookup(std::istream &index, const CDHash &cdhash) {
+    index.seekg(0);
+    if (ReadBE::readUInt32(index) != magic) {
+        throw std::runtime_error{"not a cdhash index"};
+    }
+    if (ReadBE::readUInt32(index) != version) {
+        throw std::runtime_error{"unsupported cdhash index version"};
+    }
+    uint32_t count = ReadBE::readUInt32(index);
+    uint32_t pathsOffset = ReadBE::readUInt32(index);
+    if (index.fail()) {
+        throw std::runtime_error{"truncated cdhash index"};
+    }
+
+    // The first record not below cdhash, comparing only the hashes
+    uint32_t low = 0, high = count;
+    while (low < high) {
+        uint32_t middle = low + (high - low) / 2;
+        CDHash probe{};
+        index.seekg(headerSize + (uint64_t) middle * recordSize);
+        index.read(probe.bytes, CDHash::size);
+        if (index.fail()) {
+            throw std::runtime_error{"truncated cdhash index"};
+        }
+        if (probe < cdhash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    std::vector<CDHashEntry> entries;
+    for (uint32_t record = low; record < count; record++) {
+        auto entry = readRecord(index, pathsOffset, record);
+        if (!(entry.cdhash == cdhash)) {
+            break;
+        }
+        entries.push_back(entry);
+    }
+    return entries;
+}
+};
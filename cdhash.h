@@ -0,0 +1,70 @@
+#ifndef SIGTOOL_CDHASH_H
+#define SIGTOOL_CDHASH_H
+
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+
+namespace SigTool {
+
+// The hash by which the kernel and trust caches identify a signed slice:
+// the SHA-256 of its code directory, truncated to 20 bytes
+struct CDHash {
+    static const int constexpr size = 20;
+    char bytes[size]{};
+
+    CDHash() = default;
+    explicit CDHash(const Hash &codeDirectoryHash);
+
+    // Throws unless given exactly 40 hex digits
+    static CDHash fromHex(const std::string &hex);
+
+    bool operator==(const CDHash &other) const {
+        return memcmp(bytes, other.bytes, size) == 0;
+    }
+
+    bool operator<(const CDHash &other) const {
+        return memcmp(bytes, other.bytes, size) < 0;
+    }
+
+    std::string hex() const;
+};
+
+struct CDHashEntry {
+    CDHash cdhash;
+    uint32_t cpuType;
+    uint32_t cpuSubType;
+    std::string path;
+};
+
+// The cdhash of each slice's embedded signature, reading only the code
+// directory blob of each. Slices without a signature are skipped.
+std::vector<CDHashEntry> readCDHashes(const std::string &filename);
+
+// Sorted, fixed size records for binary search by cdhash. All big endian:
+//   magic, version, count, pathsOffset
+//   count * { cdhash (20 bytes), cpuType, cpuSubType, pathOffset }
+//   NUL terminated paths
+// pathOffset is relative to pathsOffset, which is relative to the start of
+// the index.
+struct CDHashIndex {
+    constexpr static const uint32_t magic = 0x73696768; // 'sigh'
+    constexpr static const uint32_t version = 1;
+    constexpr static const uint32_t headerSize = 4 * sizeof(uint32_t);
+    constexpr static const uint32_t recordSize = CDHash::size + 3 * sizeof(uint32_t);
+
+    // Sorts the entries
+    static void emit(std::ostream &os, std::vector<CDHashEntry> entries);
+
+    // "cdhash arch path" lines, sorted by cdhash
+    static void emitText(std::ostream &os, std::vector<CDHashEntry> entries);
+
+    // The entries with this cdhash, reading O(log n) records of the index
+    static std::vector<CDHashEntry> lookup(std::istream &index, const CDHash &cdhash);
+};
+};
+
+#endif //SIGTOOL_CDHASH_H
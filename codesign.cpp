@@ -1,4 +1,5 @@
 #include "commands.h"
+#include "governor.h"
 #include <CLI11.hpp>
 
 int main(int argc, char **argv) {
@@ -6,15 +7,34 @@ int main(int argc, char **argv) {
 
     std::string identity, identifier, entitlements;
     bool force = false;
+    bool atomic = false;
+    std::string skipIfCurrent;
+    unsigned int jobs = 0;
     std::vector<std::string> files;
     app.add_option("-s,--sign", identity, "Code signing identity")->required();
     app.add_option("-i,--identifier", identifier, "File identifier");
     app.add_flag("-f,--force", force, "Replace any existing signatures");
+    app.add_flag("--atomic", atomic, "Re-sign through a temporary copy instead of in place");
+    app.add_option("--skip-if-current", skipIfCurrent,
+                   "Leave files already carrying the requested signature untouched, checking a sample or all of the pages")
+            ->check(CLI::IsMember({"sample", "full"}));
+    app.add_option("-j,--jobs", jobs, "Worker threads when signing bundles, defaults to one per CPU");
     app.add_option("--entitlements", entitlements, "Entitlements plist");
     app.add_option("files", files, "Files to sign");
 
+    uint64_t ioRate = 0;
+    double cpuShare = 1.0;
+    bool psiBackoff = false;
+    app.add_option("--io-rate", ioRate, "Read and write budget in bytes per second, e.g. 50MB")
+            ->transform(CLI::AsSizeValue(false));
+    app.add_option("--cpu-share", cpuShare, "Fraction of time each signing thread may spend on the CPU")
+            ->check(CLI::Range(0.01, 1.0));
+    app.add_flag("--psi-backoff", psiBackoff, "Lower the IO budget while /proc/pressure/io reports contention");
+
     CLI11_PARSE(app, argc, argv);
 
+    SigTool::Governor::shared().setLimits({ioRate, cpuShare, psiBackoff});
+
     if (identity != std::string{"-"}) {
         throw std::runtime_error{
                 std::string{"Only ad-hoc identities supported, requested: '"} + identity + "'"};
@@ -24,6 +44,14 @@ int main(int argc, char **argv) {
             .identifier = identifier,
             .entitlements = entitlements,
             .force = force,
+            .atomic = atomic,
+            .skipIfCurrent = skipIfCurrent == "full" ? SigTool::Commands::SkipCheck::Full
+                           : skipIfCurrent == "sample" ? SigTool::Commands::SkipCheck::Sample
+                           : SigTool::Commands::SkipCheck::Never,
+            .infoPlist = "",
+            .resources = "",
+            .jobs = jobs,
+            .cancel = nullptr,
     };
 
     for (const auto &f : files) {
@@ -1,62 +1,40 @@
 #include <algorithm>
+#include <chrono>
 #include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <sstream>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <spawn.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+
+#include "archive.h"
 #include "commands.h"
+#include "governor.h"
 #include "macho.h"
+#include "manifest.h"
+#include "probes.h"
 #include "signature.h"
+#include "signer.h"
 
 extern char **environ;
 
 namespace SigTool {
 
-constexpr const unsigned int pageSize = 4096;
-
-static std::string readFile(const std::string &filename) {
-    std::ifstream in{filename, std::ifstream::in | std::ifstream::binary};
-    if (!in.is_open()) {
-        throw std::runtime_error{"Failed opening file for read: '"
-                                 + filename + "' :" + strerror(errno)};
-    }
-
-    std::string str;
-
-    in.seekg(0, std::ifstream::end);
-    str.resize(in.tellg());
-    in.seekg(0, std::ifstream::beg);
-    in.read(&str[0], str.size());
-
-    return str;
-}
-
-static Hash hashBlob(const std::shared_ptr<Blob> &blob) {
-    std::basic_ostringstream<char> buf;
-    blob->emit(buf);
-    return Hash{buf.str()};
-}
-
-std::string cpuTypeName(uint32_t cpuType, uint32_t cpuSubType) {
-    switch (cpuType | cpuSubType) {
-        case CPUTYPE_X86_64:
-            return "x86_64";
-        case CPUTYPE_X86_64H:
-            return "x86_64h";
-        case CPUTYPE_ARM64:
-            return "arm64";
-        case CPUTYPE_ARM64E:
-            return "arm64e";
-        default:
-            throw std::runtime_error{std::string{"Unsupported cpu type"} + std::to_string(cpuType)};
-    }
-}
-
 int Commands::checkRequiresSignature(const std::string &file) {
     try {
         MachOList test{file};
@@ -80,278 +58,1938 @@ int Commands::showArch(const std::string &file) {
     return 0;
 }
 
+
+// Read and hash a page from a stream positioned at its start
+static Hash readPageHash(std::istream &in, unsigned int page, size_t limit) {
+    char pageBytes[pageSize];
+
+    uint64_t thisPageStart = (uint64_t) page * pageSize;
+    size_t thisPageSize = pageSize;
+
+    if (thisPageStart + thisPageSize > limit) {
+        thisPageSize = limit - thisPageStart;
+    }
+
+    in.read(&pageBytes[0], thisPageSize);
+    if (in.fail()) {
+        throw std::runtime_error(std::string{"reading page: "}
+                                 + std::to_string(page) + " " + strerror(errno) + " expcted_bytes="
+                                 + std::to_string(thisPageSize) + " actual_bytes" +
+                                 std::to_string(in.gcount()));
+    }
+
+    return Hash{&pageBytes[0], thisPageSize};
+}
+
+static std::ifstream openMachO(const std::string &filename) {
+    std::ifstream machoFileRaw;
+    machoFileRaw.open(filename, std::ifstream::in | std::ifstream::binary);
+
+    if (machoFileRaw.fail()) {
+        throw std::runtime_error(std::string{"opening macho file: "} + strerror(errno));
+    }
+    SIGTOOL_PROBE1(file__open, filename.c_str());
+
+    return machoFileRaw;
+}
+
+// Pages hashed between checks for cancellation and throttling
+constexpr const unsigned int batchPages = 256;
+
+static void checkCancelled(const Commands::SignOptions &options) {
+    if (options.cancel && options.cancel->load(std::memory_order_relaxed)) {
+        throw Commands::Cancelled{};
+    }
+}
+
+// Called before each batch of pages with the bytes it will read. cpuMark is
+// the thread's CPU time at the start of the previous batch.
+static void paceBatch(const Commands::SignOptions &options, uint64_t bytes, std::chrono::nanoseconds &cpuMark) {
+    checkCancelled(options);
+
+    auto &governor = Governor::shared();
+    governor.throttleCPU(Governor::threadCPUTime() - cpuMark);
+    governor.throttleIO(bytes);
+    cpuMark = Governor::threadCPUTime();
+}
+
+// The regions of a file holding data, as reported by SEEK_DATA and
+// SEEK_HOLE, so that pages lying wholly in holes need not be read. Where
+// holes cannot be queried, everything counts as data.
+class DataExtents {
+public:
+    DataExtents(const std::string &filename, uint64_t start, uint64_t end) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return;
+        }
+        scan(fd, start, end);
+        close(fd);
+    }
+
+    DataExtents(int fd, uint64_t start, uint64_t end) {
+        scan(fd, start, end);
+    }
+
+    // Whether [start, end) lies entirely within a hole
+    bool isHole(uint64_t start, uint64_t end) const {
+        if (!known) {
+            return false;
+        }
+        auto extent = std::upper_bound(extents.begin(), extents.end(), start,
+                                       [](uint64_t offset, const std::pair<uint64_t, uint64_t> &extent) {
+                                           return offset < extent.second;
+                                       });
+        return extent == extents.end() || extent->first >= end;
+    }
+
+    // The parts of [start, end) holding data, all of it if holes are unknown
+    std::vector<std::pair<uint64_t, uint64_t>> dataWithin(uint64_t start, uint64_t end) const {
+        if (!known) {
+            return {{start, end}};
+        }
+        std::vector<std::pair<uint64_t, uint64_t>> within;
+        for (const auto &extent : extents) {
+            uint64_t from = std::max(start, extent.first), to = std::min(end, extent.second);
+            if (from < to) {
+                within.emplace_back(from, to);
+            }
+        }
+        return within;
+    }
+
+private:
+    bool known = false;
+    // Sorted, non-overlapping [start, end) ranges of data
+    std::vector<std::pair<uint64_t, uint64_t>> extents;
+
+    void scan(int fd, uint64_t start, uint64_t end) {
+#ifdef SEEK_DATA
+        uint64_t position = start;
+        while (position < end) {
+            off_t data = lseek(fd, position, SEEK_DATA);
+            if (data == -1) {
+                // ENXIO: only a hole remains. Anything else: holes are not
+                // supported here.
+                known = errno == ENXIO;
+                break;
+            }
+            off_t hole = lseek(fd, data, SEEK_HOLE);
+            if (hole == -1) {
+                break;
+            }
+            extents.emplace_back(data, hole);
+            position = hole;
+        }
+        if (position >= end) {
+            known = true;
+        }
+#endif
+    }
+};
+
+static Hash zeroPageHash(size_t length) {
+    static const Hash fullPage{std::string(pageSize, '\0')};
+    return length == pageSize ? fullPage : Hash{std::string(length, '\0')};
+}
+
+static void hashPages(
+        const Commands::SignOptions &options,
+        std::istream &in,
+        const std::shared_ptr<MachO> &target,
+        const std::function<void(const Hash &)> &addHash,
+        const DataExtents *extents
+) {
+    size_t limit = codeLimitOf(target);
+
+    in.seekg(target->offset);
+    bool positioned = true;
+
+    unsigned int totalPages = pageCountOf(limit);
+
+    SIGTOOL_PROBE2(hash__start, target->offset, totalPages);
+    auto cpuMark = Governor::threadCPUTime();
+    for (unsigned int page = 0; page < totalPages; page++) {
+        if (page % batchPages == 0) {
+            paceBatch(options, (uint64_t) std::min(batchPages, totalPages - page) * pageSize, cpuMark);
+        }
+
+        uint64_t pageStart = (uint64_t) page * pageSize;
+        size_t thisPageSize = std::min<uint64_t>(pageSize, limit - pageStart);
+        if (extents && extents->isHole(target->offset + pageStart, target->offset + pageStart + thisPageSize)) {
+            addHash(zeroPageHash(thisPageSize));
+            positioned = false;
+            continue;
+        }
+
+        if (!positioned) {
+            in.seekg(target->offset + pageStart);
+            positioned = true;
+        }
+        addHash(readPageHash(in, page, limit));
+    }
+    SIGTOOL_PROBE2(hash__end, target->offset, totalPages);
+}
+
+
+// Sign a slice of the file held by the stream
 static SuperBlob signMachO(
         const Commands::SignOptions &options,
-        const std::shared_ptr<MachO> &target
+        const std::shared_ptr<MachO> &target,
+        std::istream &in,
+        const DataExtents *extents = nullptr
 ) {
     SuperBlob sb{};
 
     // blob 1: code directory
-    auto codeDirectory = std::make_shared<CodeDirectory>();
+    auto codeDirectory = prepareCodeDirectory(options, target);
+    hashPages(options, in, target, [&](const Hash &hash) { codeDirectory->addCodeHash(hash); }, extents);
+    sb.blobs.push_back(codeDirectory);
 
-    codeDirectory->identifier = options.identifier.empty() ? options.filename : options.identifier;
-    codeDirectory->setPageSize(pageSize);
+    addSpecialBlobs(options, codeDirectory, sb);
 
-    // TOOD: is this sane?
-    if (target->header.filetype == MH_EXECUTE) {
-        codeDirectory->data.execSegFlags |= CS_EXECSEG_MAIN_BINARY;
-    }
+    return sb;
+}
+
+static SuperBlob signMachO(
+        const Commands::SignOptions &options,
+        const std::shared_ptr<MachO> &target
+) {
+    std::ifstream machoFileRaw = openMachO(options.filename);
+    DataExtents extents{options.filename, (uint64_t) target->offset, target->offset + codeLimitOf(target)};
+    return signMachO(options, target, machoFileRaw, &extents);
+}
 
-    auto textSegment = target->getSegment64LoadCommand("__TEXT");
-    if (textSegment) {
-        codeDirectory->data.execSegBase = textSegment->data.fileoff;
-        codeDirectory->data.execSegLimit = textSegment->data.fileoff + textSegment->data.filesize;
+// The pages checked by SkipCheck::Sample: the first page, holding the
+// headers and load commands, the last page, and an even spread in between.
+static std::vector<unsigned int> samplePages(unsigned int totalPages) {
+    constexpr const unsigned int samples = 16;
+
+    std::vector<unsigned int> pages;
+    if (totalPages == 0) {
+        return pages;
     }
 
-    size_t limit = target->size;
+    unsigned int stride = std::max(1u, totalPages / samples);
+    for (unsigned int page = 0; page < totalPages; page += stride) {
+        pages.push_back(page);
+    }
+    if (pages.back() != totalPages - 1) {
+        pages.push_back(totalPages - 1);
+    }
+    return pages;
+}
 
+// Determine whether the target already carries exactly the signature that
+// would be generated for it, without hashing more of it than requested.
+static bool isSignatureCurrent(
+        const Commands::SignOptions &options,
+        const std::shared_ptr<MachO> &target,
+        Commands::SkipCheck check
+) {
     auto codeSignature = target->getCodeSignatureLoadCommand();
-    if (codeSignature) {
-        limit = codeSignature->data.dataOff;
-        codeDirectory->setCodeLimit(codeSignature->data.dataOff);
+    if (!codeSignature) {
+        return false;
     }
 
-    std::ifstream machoFileRaw;
-    machoFileRaw.open(options.filename, std::ifstream::in | std::ifstream::binary);
-    machoFileRaw.seekg(target->offset);
+    std::ifstream machoFileRaw = openMachO(options.filename);
 
-    if (machoFileRaw.fail()) {
-        throw std::runtime_error(std::string{"opening macho file: "} + strerror(errno));
+    SuperBlob existing{};
+    try {
+        existing = SuperBlob::parse(target->readCodeSignatureData(machoFileRaw));
+    } catch (std::runtime_error &e) {
+        return false;
     }
 
-    unsigned int totalPages = (limit + (pageSize - 1)) / pageSize;
+    auto existingDirectory = existing.codeDirectory();
+    if (!existingDirectory) {
+        return false;
+    }
 
-    for (int page = 0; page < totalPages; page++) {
-        char pageBytes[pageSize];
+    size_t limit = codeLimitOf(target);
+    unsigned int totalPages = pageCountOf(limit);
 
-        off_t thisPageStart = page * pageSize;
-        size_t thisPageSize = pageSize;
+    SuperBlob expected{};
+    auto expectedDirectory = prepareCodeDirectory(options, target);
+    expectedDirectory->data.nCodeSlots = totalPages;
+    expected.blobs.push_back(expectedDirectory);
+    addSpecialBlobs(options, expectedDirectory, expected);
 
-        if (thisPageStart + thisPageSize > limit) {
-            thisPageSize = limit - thisPageStart;
+    if (existing.blobs.size() != expected.blobs.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < expected.blobs.size(); i++) {
+        if (existing.blobs[i]->slotType() != expected.blobs[i]->slotType()) {
+            return false;
         }
+    }
 
-        machoFileRaw.read(&pageBytes[0], thisPageSize);
-        if (machoFileRaw.fail()) {
-            throw std::runtime_error(std::string{"reading page: "}
-                                     + std::to_string(page) + " " + strerror(errno) + " expcted_bytes="
-                                     + std::to_string(thisPageSize) + " actual_bytes" +
-                                     std::to_string(machoFileRaw.gcount()));
+    const auto &have = existingDirectory->data;
+    const auto &want = expectedDirectory->data;
+    if (have.version != want.version || have.flags != want.flags ||
+        have.hashType != want.hashType || have.hashSize != want.hashSize ||
+        have.pageSize != want.pageSize || have.platform != want.platform ||
+        have.codeLimit != want.codeLimit || have.codeLimit64 != want.codeLimit64 ||
+        have.nCodeSlots != want.nCodeSlots || have.nSpecialSlots != want.nSpecialSlots ||
+        have.scatterOffset != 0 || have.teamOffset != 0 ||
+        have.execSegBase != want.execSegBase || have.execSegLimit != want.execSegLimit ||
+        have.execSegFlags != want.execSegFlags ||
+        existingDirectory->identifier != expectedDirectory->identifier) {
+        return false;
+    }
+
+    for (unsigned int slot = 1; slot <= want.nSpecialSlots; slot++) {
+        if (existingDirectory->getSpecialHash(slot) != expectedDirectory->getSpecialHash(slot)) {
+            return false;
         }
+    }
 
-        Hash pageHash{&pageBytes[0], thisPageSize};
-        codeDirectory->addCodeHash(pageHash);
+    if (check == Commands::SkipCheck::Full) {
+        machoFileRaw.seekg(target->offset);
+        for (unsigned int page = 0; page < totalPages; page++) {
+            if (readPageHash(machoFileRaw, page, limit) != existingDirectory->codeHashes[page]) {
+                return false;
+            }
+        }
+    } else {
+        for (unsigned int page : samplePages(totalPages)) {
+            machoFileRaw.seekg(target->offset + (off_t)page * pageSize);
+            if (readPageHash(machoFileRaw, page, limit) != existingDirectory->codeHashes[page]) {
+                return false;
+            }
+        }
     }
 
-    machoFileRaw.close();
+    return true;
+}
 
-    sb.blobs.push_back(codeDirectory);
+// An exclusive flock on a file being signed, so that concurrent signers of
+// the same file take turns. Whoever waited finds the file already signed
+// and can leave it be. As the lock is held on the inode, a file replaced by
+// rename while waiting is locked again under its new inode.
+class SigningLock {
+public:
+    explicit SigningLock(const std::string &filename) {
+        auto start = std::chrono::steady_clock::now();
+        for (;;) {
+            fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                throw std::runtime_error{std::string{"opening "} + filename + " to lock: " + strerror(errno)};
+            }
+
+            if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+                if (errno != EWOULDBLOCK) {
+                    close(fd);
+                    throw std::runtime_error{std::string{"locking "} + filename + ": " + strerror(errno)};
+                }
+                contended = true;
+                while (flock(fd, LOCK_EX) != 0) {
+                    if (errno != EINTR) {
+                        close(fd);
+                        throw std::runtime_error{std::string{"locking "} + filename + ": " + strerror(errno)};
+                    }
+                }
+            }
+
+            struct stat locked{}, current{};
+            if (fstat(fd, &locked) == 0 && stat(filename.c_str(), &current) == 0 &&
+                locked.st_dev == current.st_dev && locked.st_ino == current.st_ino) {
+                break;
+            }
+            close(fd);
+        }
 
-    // blob 2: requirements index with 0 entries
-    auto requirements = std::make_shared<Requirements>();
-    codeDirectory->setSpecialHash(requirements->slotType(), hashBlob(requirements));
-    sb.blobs.push_back(requirements);
+        if (contended) {
+            auto waitedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+            SIGTOOL_PROBE2(lock__wait, filename.c_str(), waitedMs);
+            std::cerr << filename << ": waited " << waitedMs << "ms for another signer" << std::endl;
+        }
+    }
 
-    // optional blob: entitlements
-    if (!options.entitlements.empty()) {
-        auto entitlements = std::make_shared<Entitlements>(readFile(options.entitlements));
-        codeDirectory->setSpecialHash(entitlements->slotType(), hashBlob(entitlements));
-        sb.blobs.push_back(entitlements);
+    ~SigningLock() {
+        close(fd);
     }
 
-    // blob: empty signature slot
-    sb.blobs.emplace_back(std::make_shared<Signature>());
+    SigningLock(const SigningLock &) = delete;
+    SigningLock &operator=(const SigningLock &) = delete;
 
-    return sb;
-}
+    // Whether another process held the lock when it was requested
+    bool waited() const {
+        return contended;
+    }
 
+private:
+    int fd = -1;
+    bool contended = false;
+};
 
 int Commands::showSize(const SignOptions &options) {
     MachOList list{options.filename};
     for (const auto &macho : list.machos) {
-        auto sb = signMachO(options, macho);
+        auto sb = prepareSignature(options, macho);
         std::cout << cpuTypeName(macho->header.cpuType, macho->header.cpuSubType) << " " << sb.length() << std::endl;
     }
 
     return 0;
 }
 
-int Commands::generate(const SignOptions &options) {
+std::vector<size_t> Commands::signatureSizes(const SignOptions &options) {
     MachOList list{options.filename};
+    std::vector<size_t> sizes;
     for (const auto &macho : list.machos) {
-        auto sb = signMachO(options, macho);
-        // TODO: packing them all together is not helpful, but this is still usable
-        // for the thin case.
-        sb.emit(std::cout);
+        sizes.push_back(prepareSignature(options, macho).length());
+    }
+    return sizes;
+}
+
+// Check a slice's existing signature against its contents. Special slots
+// for files outside the binary, such as a bundle's resources, cannot be
+// checked here and are ignored.
+static bool verifyMachO(
+        const Commands::SignOptions &options,
+        const std::shared_ptr<MachO> &target,
+        std::istream &in
+) {
+    SuperBlob sb{};
+    try {
+        sb = SuperBlob::parse(target->readCodeSignatureData(in));
+    } catch (std::runtime_error &e) {
+        return false;
+    }
+
+    auto codeDirectory = sb.codeDirectory();
+    if (!codeDirectory || codeDirectory->data.hashType != Hash::hashType ||
+        codeDirectory->data.hashSize != Hash::hashSize) {
+        return false;
+    }
+
+    for (const auto &blob : sb.blobs) {
+        uint32_t slot = blob->slotType();
+        if (slot == CSSLOT_CODEDIRECTORY || slot == CSSLOT_SIGNATURESLOT ||
+            slot >= CSSLOT_ALTERNATE_CODEDIRECTORIES) {
+            continue;
+        }
+        if (slot > codeDirectory->data.nSpecialSlots ||
+            codeDirectory->getSpecialHash(slot) != hashBlob(blob)) {
+            return false;
+        }
     }
 
+    if (codeDirectory->data.pageSize == 0 || codeDirectory->data.pageSize > 16) {
+        return false;
+    }
+    uint64_t limit = codeDirectory->codeLimit();
+    uint64_t verifyPageSize = uint64_t{1} << codeDirectory->data.pageSize;
+    uint64_t totalPages = (limit + verifyPageSize - 1) / verifyPageSize;
+    if (totalPages != codeDirectory->codeHashes.size() || limit > target->size) {
+        return false;
+    }
+
+    std::vector<char> pageBytes(verifyPageSize);
+    in.clear();
+    in.seekg(target->offset);
+    auto cpuMark = Governor::threadCPUTime();
+    for (uint64_t page = 0; page < totalPages; page++) {
+        if (page % batchPages == 0) {
+            paceBatch(options, std::min<uint64_t>(batchPages, totalPages - page) * verifyPageSize, cpuMark);
+        }
+        size_t thisPageSize = std::min(verifyPageSize, limit - page * verifyPageSize);
+        in.read(pageBytes.data(), thisPageSize);
+        if (in.fail() || Hash{pageBytes.data(), thisPageSize} != codeDirectory->codeHashes[page]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int Commands::verify(const SignOptions &options) {
+    MachOList list{options.filename};
+    std::ifstream machoFileRaw = openMachO(options.filename);
+
+    for (const auto &macho : list.machos) {
+        if (!macho->getCodeSignatureLoadCommand() || !verifyMachO(options, macho, machoFileRaw)) {
+            return 1;
+        }
+    }
     return 0;
 }
 
-int Commands::inject(const SignOptions &options) {
+int Commands::generate(const SignOptions &options) {
+    return generate(options, GenerateOptions{});
+}
+
+// Absolute file offset the signature of a slice is injected at, or 0 when
+// the slice has no reservation yet.
+static uint64_t signatureOffsetOf(const std::shared_ptr<MachO> &macho) {
+    auto codeSignature = macho->getCodeSignatureLoadCommand();
+    return codeSignature ? macho->offset + codeSignature->data.dataOff : 0;
+}
+
+int Commands::generate(const SignOptions &options, const GenerateOptions &generateOptions) {
     MachOList list{options.filename};
+
+    std::vector<std::string> signatures;
     for (const auto &macho : list.machos) {
         auto sb = signMachO(options, macho);
+        std::ostringstream buf;
+        sb.emit(buf);
+        signatures.push_back(buf.str());
+    }
 
-        auto codeSignature = macho->getCodeSignatureLoadCommand();
-
-        if (!codeSignature) {
-            throw std::runtime_error{"cannot inject signature without appropriate load command"};
+    if (!generateOptions.outputDir.empty()) {
+        // Check the names up front so that no file is left half written
+        std::set<std::string> archs;
+        for (const auto &macho : list.machos) {
+            std::string arch = cpuTypeName(macho->header.cpuType, macho->header.cpuSubType);
+            if (!archs.insert(arch).second) {
+                throw std::runtime_error{"more than one " + arch + " slice would be written to " + arch + ".sig"};
+            }
         }
 
-        if (sb.length() > codeSignature->data.dataSize) {
-            throw std::runtime_error{
-                    std::string{"allocated size too small: need "}
-                    + std::to_string(sb.length())
-                    + std::string{" but have "}
-                    + std::to_string(codeSignature->data.dataSize)
-            };
-        }
+        for (size_t i = 0; i < list.machos.size(); i++) {
+            const auto &macho = list.machos[i];
+            std::string arch = cpuTypeName(macho->header.cpuType, macho->header.cpuSubType);
+            std::string path = generateOptions.outputDir + "/" + arch + ".sig";
+
+            std::ofstream out{path, std::ofstream::out | std::ofstream::binary | std::ofstream::trunc};
+            out << signatures[i];
+            out.close();
+            if (out.fail()) {
+                throw std::runtime_error{"writing " + path + ": " + strerror(errno)};
+            }
 
-        std::ofstream machoFileWrite;
-        machoFileWrite.open(options.filename, std::ofstream::in | std::ofstream::out | std::ofstream::binary);
-        if (machoFileWrite.fail()) {
-            throw std::runtime_error(std::string{"opening macho file: "} + strerror(errno));
+            std::cout << arch << " " << signatureOffsetOf(macho) << " " << signatures[i].size()
+                      << " " << path << std::endl;
+        }
+    } else if (generateOptions.indexed) {
+        // Header, then an index entry per slice, then the signatures
+        uint32_t dataOffset = 3 * sizeof(uint32_t) + list.machos.size() * indexedEntrySize;
+
+        EmitBE::writeUInt32(std::cout, indexedMagic);
+        EmitBE::writeUInt32(std::cout, 1); // version
+        EmitBE::writeUInt32(std::cout, list.machos.size());
+
+        for (size_t i = 0; i < list.machos.size(); i++) {
+            const auto &macho = list.machos[i];
+            EmitBE::writeUInt32(std::cout, macho->header.cpuType);
+            EmitBE::writeUInt32(std::cout, macho->header.cpuSubType);
+            EmitBE::writeUInt64(std::cout, macho->offset);
+            EmitBE::writeUInt64(std::cout, signatureOffsetOf(macho));
+            EmitBE::writeUInt32(std::cout, dataOffset);
+            EmitBE::writeUInt32(std::cout, signatures[i].size());
+            dataOffset += signatures[i].size();
         }
 
-        machoFileWrite.seekp(macho->offset + codeSignature->data.dataOff);
-        sb.emit(machoFileWrite);
-        machoFileWrite.close();
+        for (const auto &signature : signatures) {
+            std::cout << signature;
+        }
+    } else {
+        // Packing them all together is only usable for the thin case.
+        for (const auto &signature : signatures) {
+            std::cout << signature;
+        }
     }
 
     return 0;
 }
 
-static char **toSpawnArgs(const std::vector<std::string> &args) {
-    char **spawnArgs = reinterpret_cast<char **>(
-            calloc(args.size() + 1, sizeof(char *)));
-    for (int i = 0; i < args.size(); i++) {
-        spawnArgs[i] = strdup(args[i].c_str());
+static void writeAll(int fd, const std::string &bytes, off_t offset) {
+    Governor::shared().throttleIO(bytes.size());
+
+    size_t written = 0;
+    while (written < bytes.size()) {
+        ssize_t result = pwrite(fd, bytes.data() + written, bytes.size() - written, offset + written);
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error{std::string{"writing signature: "} + strerror(errno)};
+        }
+        written += result;
     }
-    spawnArgs[args.size()] = nullptr;
-    return spawnArgs;
 }
 
-static void freeArgs(char **spawnArgs, std::vector<std::string>::size_type size) {
-    for (int i = 0; i < size; i++) {
-        free(spawnArgs[i]);
-    }
-    free(spawnArgs);
-}
 
-static std::string inferIdentifier(const std::string& filename) {
-    // basename / basename_r are awkward to use. We don't need the exact
-    // meaning of basename.
+static void writeSignature(int fd, const std::shared_ptr<MachO> &macho, SuperBlob &sb) {
+    std::string bytes = signatureBytes(macho, sb);
+    auto codeSignature = macho->getCodeSignatureLoadCommand();
+    SIGTOOL_PROBE2(inject, macho->offset + codeSignature->data.dataOff, bytes.size());
+    writeAll(fd, bytes, macho->offset + codeSignature->data.dataOff);
+}
 
-    const auto slash = filename.find_last_of('/');
-    if (slash == std::string::npos) {
-        return filename;
+// Write the signatures of every slice, after checking that each fits its
+// reservation, so that a signature too large for a later slice does not
+// leave the earlier ones already overwritten
+static void writeSignatures(int fd, const MachOList &list, std::vector<SuperBlob> &signatures) {
+    for (size_t i = 0; i < list.machos.size(); i++) {
+        checkReservation(list.machos[i], signatures[i]);
     }
-    std::string basename = filename.substr(slash + 1);
-    if (basename.empty()) {
-        return filename;
+    for (size_t i = 0; i < list.machos.size(); i++) {
+        writeSignature(fd, list.machos[i], signatures[i]);
     }
-    return basename;
 }
 
-int Commands::codesign(const CodesignOptions &options, const std::string &filename) {
-    std::string identifier = options.identifier;
-    if (identifier.empty()) {
-        identifier = inferIdentifier(filename);
+// Sign every slice in memory, holding 32 bytes per page, before writing
+// any of the signatures through fd. Files others can see are signed this
+// way: being cancelled, failing to read a page or waiting on the governor
+// leaves their existing signatures untouched.
+static std::vector<SuperBlob> signInPlace(const Commands::SignOptions &options, const MachOList &list, int fd) {
+    std::vector<SuperBlob> signatures;
+    for (const auto &macho : list.machos) {
+        signatures.push_back(signMachO(options, macho));
     }
-    // Parse and discovery arguments
-    MachOList list{filename};
-    std::vector<std::string> arguments;
-
-    arguments.emplace_back("codesign_allocate");
-    arguments.emplace_back("-i");
-    arguments.emplace_back(filename);
-
+    writeSignatures(fd, list, signatures);
+    return signatures;
+}
 
-    for (const auto &macho : list.machos) {
+// Writes a prepared signature into a slice's reservation, taking the page
+// hashes as they are produced, so that memory use does not grow with the
+// slice. The code directory is hashed along the way, for its cdhash.
+//
+// The reservation holds an invalid signature until finish(), so this is
+// only for files nobody else can see yet, such as a copy to be renamed
+// over the original.
+class SignatureWriter {
+public:
+    SignatureWriter(int fd, const std::shared_ptr<MachO> &macho, SuperBlob &sb) : fd(fd) {
+        checkReservation(macho, sb);
         auto codeSignature = macho->getCodeSignatureLoadCommand();
-        if (!options.force && codeSignature) {
-            throw std::runtime_error{"file is already signed. pass -f to sign regardless."};
+
+        uint64_t base = macho->offset + codeSignature->data.dataOff;
+        SIGTOOL_PROBE2(inject, base, codeSignature->data.dataSize);
+
+        std::ostringstream header;
+        sb.emitHeader(header);
+        writeAll(fd, header.str(), base);
+
+        uint64_t offset = header.str().size();
+        for (const auto &blob : sb.blobs) {
+            std::ostringstream buf;
+            blob->emit(buf);
+            writeAll(fd, buf.str(), base + offset);
+            if (blob->slotType() == CSSLOT_CODEDIRECTORY) {
+                codeDirectory = std::static_pointer_cast<CodeDirectory>(blob);
+                hasher.update(buf.str().data(), buf.str().size());
+                next = base + offset + buf.str().size();
+            }
+            offset += blob->length();
+        }
+        if (!codeDirectory) {
+            throw std::runtime_error{"signature has no code directory"};
         }
-        auto sb = signMachO(SignOptions{
-                .filename = filename,
-                .identifier = identifier,
-                .entitlements = options.entitlements,
-        }, macho);
 
+        // Clear out the rest of the reservation, which may still hold the
+        // tail of a previous, larger signature
+        std::string zeros(std::min<uint64_t>(1 << 16, codeSignature->data.dataSize - offset), '\0');
+        while (offset < codeSignature->data.dataSize) {
+            size_t n = std::min<uint64_t>(zeros.size(), codeSignature->data.dataSize - offset);
+            writeAll(fd, zeros.substr(0, n), base + offset);
+            offset += n;
+        }
+    }
 
-        arguments.emplace_back("-A");
-        arguments.emplace_back(std::to_string(macho->header.cpuType));
-        arguments.emplace_back(std::to_string(macho->header.cpuSubType & ~CPU_SUBTYPE_MASK));
+    SignatureWriter(const SignatureWriter &) = delete;
+    SignatureWriter &operator=(const SignatureWriter &) = delete;
 
-        size_t len = sb.length();
-        len = ((len + 0xf) & ~0xf) + 1024; // align and pad
-        arguments.push_back(std::to_string(len));
+    void addCodeHash(const Hash &hash) {
+        pending.append(hash.bytes, sizeof(hash.bytes));
+        added++;
+        if (pending.size() >= batchPages * sizeof(Hash::bytes)) {
+            flush();
+        }
     }
 
-    // Make temporary name
-    std::unique_ptr<char, decltype(&std::free)> tempfileName { strdup((filename + "XXXXXX").c_str()), std::free };
-    int tempfile = mkstemp(tempfileName.get());
-
-    // Preserve mode
-    struct stat sourceFileStat{};
-    if (stat(filename.c_str(), &sourceFileStat) != 0) {
-        throw std::runtime_error{std::string{"stat of "} + filename + " failed: " + strerror(errno)};
+    // The hash of the complete code directory
+    Hash finish() {
+        flush();
+        if (added != codeDirectory->data.nCodeSlots) {
+            throw std::runtime_error{"page count changed while signing"};
+        }
+        return hasher.finish();
     }
 
-    if (fchmod(tempfile, sourceFileStat.st_mode) != 0) {
-        throw std::runtime_error{"chmod temporary file"};
+private:
+    int fd;
+    std::shared_ptr<CodeDirectory> codeDirectory;
+    Hasher<Hash> hasher;
+    // Where the next code hash goes, and those not yet written
+    uint64_t next = 0;
+    std::string pending;
+    uint32_t added = 0;
+
+    void flush() {
+        hasher.update(pending.data(), pending.size());
+        writeAll(fd, pending, next);
+        next += pending.size();
+        pending.clear();
     }
+};
 
-    arguments.emplace_back("-o");
-    arguments.emplace_back(std::string(tempfileName.get()));
+// Sign a slice straight into its reservation through fd, reading the pages
+// from options.filename, which must not be visible to others yet. Returns
+// the hash of the code directory.
+static Hash injectMachO(const Commands::SignOptions &options, const std::shared_ptr<MachO> &target, int fd) {
+    auto sb = prepareSignature(options, target);
+    SignatureWriter writer{fd, target, sb};
 
-    // codesign_allocate
-    pid_t pid;
-    char **spawnArgs = toSpawnArgs(arguments);
+    std::ifstream machoFileRaw = openMachO(options.filename);
+    DataExtents extents{options.filename, (uint64_t) target->offset, target->offset + codeLimitOf(target)};
+    hashPages(options, machoFileRaw, target, [&](const Hash &hash) { writer.addCodeHash(hash); }, &extents);
 
-    const char *codesign_allocate = getenv("CODESIGN_ALLOCATE");
-    if (!codesign_allocate) {
-        codesign_allocate = "codesign_allocate";
-    }
+    return writer.finish();
+}
 
-    int spawn_result;
-    if ((spawn_result = posix_spawnp(&pid, codesign_allocate, nullptr, nullptr, spawnArgs, environ)) != 0) {
-        throw std::runtime_error{std::string{"Failed to spawn codesign_allocate: "} + strerror(spawn_result)};
-    };
+int Commands::inject(const SignOptions &options) {
+    std::vector<CDHashEntry> cdhashes;
+    return inject(options, cdhashes);
+}
 
-    int codesign_status;
-    pid_t waitpid_result;
-    do {
-        waitpid_result = waitpid(pid, &codesign_status, 0);
-    } while (waitpid_result == -1 && errno == EINTR);
-    if (waitpid_result == -1) {
-        throw std::runtime_error{
-                std::string{"codesign waitpid failed: "} + strerror(errno)
-        };
+int Commands::inject(const SignOptions &options, std::vector<CDHashEntry> &cdhashes) {
+    SigningLock lock{options.filename};
+    MachOList list{options.filename};
+
+    // Whoever held the lock has most likely just signed the file the same way
+    if (lock.waited()) {
+        bool current = std::all_of(list.machos.begin(), list.machos.end(), [&](const std::shared_ptr<MachO> &macho) {
+            return isSignatureCurrent(options, macho, SkipCheck::Full);
+        });
+        if (current) {
+            cdhashes = readCDHashes(options.filename);
+            return 0;
+        }
     }
 
-    freeArgs(spawnArgs, arguments.size());
+    int fd = open(options.filename.c_str(), O_WRONLY);
+    if (fd == -1) {
+        throw std::runtime_error(std::string{"opening macho file: "} + strerror(errno));
+    }
 
-    if (!WIFEXITED(codesign_status) || WEXITSTATUS(codesign_status) != 0) {
-        throw std::runtime_error{std::string{"codesign_failed: "} + std::to_string(WEXITSTATUS(codesign_status))};
+    try {
+        auto signatures = signInPlace(options, list, fd);
+        for (size_t i = 0; i < list.machos.size(); i++) {
+            const auto &macho = list.machos[i];
+            cdhashes.push_back(CDHashEntry{CDHash{hashBlob(signatures[i].codeDirectory())}, macho->header.cpuType,
+                                           macho->header.cpuSubType, options.filename});
+        }
+    } catch (...) {
+        close(fd);
+        throw;
     }
 
-    if (close(tempfile) != 0) {
-        throw std::runtime_error{std::string{"close: "} + strerror(tempfile)};
+    if (close(fd) != 0) {
+        throw std::runtime_error{std::string{"close: "} + strerror(errno)};
     }
 
-    // inject
-    Commands::inject(SignOptions{
-            .filename = std::string(tempfileName.get()),
-            .identifier = identifier,
-            .entitlements = options.entitlements,
-    });
+    return 0;
+}
 
-    // rename temp file to output
-    if (rename(tempfileName.get(), filename.c_str()) != 0) {
-        throw std::runtime_error{"rename failed"};
-    }
+std::vector<Commands::ByteRange> Commands::parseByteRanges(std::istream &is) {
+    std::vector<ByteRange> ranges;
+    std::string line;
+    unsigned int lineNumber = 0;
+
+    while (std::getline(is, line)) {
+        lineNumber++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        const char *start = line.c_str();
+        char *end = nullptr;
+        errno = 0;
+        uint64_t offset = strtoull(start, &end, 0);
+        const char *lengthStart = end;
+        uint64_t length = strtoull(lengthStart, &end, 0);
+
+        if (errno != 0 || end == lengthStart || end == start) {
+            throw std::runtime_error{"malformed byte range on line " + std::to_string(lineNumber) + ": " + line};
+        }
+
+        ranges.push_back(ByteRange{offset, length});
+    }
+
+    return ranges;
+}
+
+// Pages of a slice overlapping any of the (absolute) dirty ranges
+static std::vector<unsigned int> dirtyPages(
+        const std::shared_ptr<MachO> &target,
+        size_t limit,
+        const std::vector<Commands::ByteRange> &dirtyRanges
+) {
+    std::vector<unsigned int> pages;
+
+    uint64_t sliceStart = target->offset;
+    uint64_t sliceEnd = sliceStart + limit;
+
+    for (const auto &range : dirtyRanges) {
+        uint64_t start = std::max<uint64_t>(range.offset, sliceStart);
+        uint64_t end = std::min<uint64_t>(range.offset + range.length, sliceEnd);
+        if (range.length == 0 || start >= end) {
+            continue;
+        }
+
+        for (uint64_t page = (start - sliceStart) / pageSize; page <= (end - 1 - sliceStart) / pageSize; page++) {
+            pages.push_back(page);
+        }
+    }
+
+    std::sort(pages.begin(), pages.end());
+    pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+    return pages;
+}
+
+static void resignMachO(
+        int fd,
+        const Commands::SignOptions &options,
+        const std::shared_ptr<MachO> &target,
+        const std::vector<Commands::ByteRange> &dirtyRanges
+) {
+    auto codeSignature = target->getCodeSignatureLoadCommand();
+    if (!codeSignature) {
+        throw std::runtime_error{"cannot resign a file without an existing signature"};
+    }
+
+    std::ifstream machoFileRaw = openMachO(options.filename);
+    std::string signatureBytes = target->readCodeSignatureData(machoFileRaw);
+    SuperBlob existing = SuperBlob::parse(signatureBytes);
+    auto codeDirectory = existing.codeDirectory();
+
+    // Only the primary code directory is patched, and only the special
+    // slots a code directory has storage for are rehashed
+    for (const auto &blob : existing.blobs) {
+        uint32_t slot = blob->slotType();
+        if (slot >= CSSLOT_ALTERNATE_CODEDIRECTORIES && slot < CSSLOT_SIGNATURESLOT) {
+            throw std::runtime_error{"existing signature has alternate code directories, sign it from scratch"};
+        }
+        if (slot > CSSLOT_DER_ENTITLEMENTS && slot != CSSLOT_SIGNATURESLOT) {
+            throw std::runtime_error{"existing signature has an unknown blob, sign it from scratch"};
+        }
+    }
+
+    size_t limit = codeLimitOf(target);
+    if (!codeDirectory ||
+        codeDirectory->data.pageSize != log2(pageSize) ||
+        codeDirectory->codeLimit() != limit ||
+        codeDirectory->data.nCodeSlots != pageCountOf(limit)) {
+        throw std::runtime_error{"existing signature does not cover this file's layout, sign it from scratch"};
+    }
+
+    // Rehash only the pages overlapping the edits
+    std::vector<unsigned int> changedPages;
+    for (unsigned int page : dirtyPages(target, limit, dirtyRanges)) {
+        machoFileRaw.seekg(target->offset + (off_t)page * pageSize);
+        Hash pageHash = readPageHash(machoFileRaw, page, limit);
+        if (pageHash != codeDirectory->codeHashes[page]) {
+            codeDirectory->codeHashes[page] = pageHash;
+            changedPages.push_back(page);
+        }
+    }
+    machoFileRaw.close();
+
+    bool newIdentifier = !options.identifier.empty() && options.identifier != codeDirectory->identifier;
+    std::shared_ptr<Entitlements> newEntitlements;
+    if (!options.entitlements.empty()) {
+        auto entitlements = std::make_shared<Entitlements>(readEntitlements(options.entitlements));
+        auto existingEntitlements = std::dynamic_pointer_cast<Entitlements>(existing.findBlob(CSSLOT_ENTITLEMENTS));
+        if (!existingEntitlements || existingEntitlements->entitlements != entitlements->entitlements) {
+            newEntitlements = entitlements;
+        }
+    }
+
+    if (!newIdentifier && !newEntitlements) {
+        // Same layout as before: patch just the changed code slots
+        off_t codeDirectoryOffset = 0;
+        for (const auto &entry : SuperBlob::parseIndex(signatureBytes)) {
+            if (entry.type == CSSLOT_CODEDIRECTORY) {
+                codeDirectoryOffset = entry.offset;
+                break;
+            }
+        }
+
+        off_t hashesStart = target->offset + codeSignature->data.dataOff
+                            + codeDirectoryOffset + codeDirectory->data.hashOffset;
+        for (unsigned int page : changedPages) {
+            const Hash &hash = codeDirectory->codeHashes[page];
+            writeAll(fd, std::string(hash.bytes, sizeof(hash.bytes)),
+                     hashesStart + (off_t)page * sizeof(Hash::bytes));
+        }
+        return;
+    }
+
+    // The special slots change, and with them the layout. Re-emitting is only
+    // safe for a code directory in the layout this tool writes.
+    const auto &data = codeDirectory->data;
+    if (data.version != CodeDirectory{}.data.version || data.scatterOffset != 0 || data.teamOffset != 0) {
+        throw std::runtime_error{"cannot change identifier or entitlements of a foreign signature, sign it from scratch"};
+    }
+
+    if (newIdentifier) {
+        codeDirectory->identifier = options.identifier;
+    }
+
+    // Keep the existing blobs, with any new entitlements ahead of the
+    // signature slot as signMachO orders them.
+    std::shared_ptr<Blob> pendingEntitlements = newEntitlements;
+    SuperBlob sb{};
+    for (const auto &blob : existing.blobs) {
+        if (newEntitlements && blob->slotType() == CSSLOT_ENTITLEMENTS) {
+            continue;
+        }
+        if (pendingEntitlements && blob->slotType() == CSSLOT_SIGNATURESLOT) {
+            sb.blobs.push_back(pendingEntitlements);
+            pendingEntitlements.reset();
+        }
+        sb.blobs.push_back(blob);
+    }
+    if (pendingEntitlements) {
+        sb.blobs.push_back(pendingEntitlements);
+    }
+
+    for (const auto &blob : sb.blobs) {
+        if (blob->slotType() > CSSLOT_CODEDIRECTORY && blob->slotType() <= CSSLOT_DER_ENTITLEMENTS) {
+            codeDirectory->setSpecialHash(blob->slotType(), hashBlob(blob));
+        }
+    }
+
+    writeSignature(fd, target, sb);
+}
+
+int Commands::resign(const SignOptions &options, const std::vector<ByteRange> &dirtyRanges) {
+    MachOList list{options.filename};
+
+    int fd = open(options.filename.c_str(), O_WRONLY);
+    if (fd == -1) {
+        throw std::runtime_error(std::string{"opening macho file: "} + strerror(errno));
+    }
+
+    try {
+        for (const auto &macho : list.machos) {
+            resignMachO(fd, options, macho, dirtyRanges);
+        }
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    if (close(fd) != 0) {
+        throw std::runtime_error{std::string{"close: "} + strerror(errno)};
+    }
+
+    return 0;
+}
+
+int Commands::manifest(const std::string &file, bool json) {
+    Manifest manifest = Manifest::fromMachO(file);
+    if (json) {
+        manifest.emitJSON(std::cout);
+    } else {
+        manifest.emit(std::cout);
+    }
+    return 0;
+}
+
+int Commands::cdhashIndex(const std::vector<std::string> &files, const std::string &output) {
+    std::vector<CDHashEntry> entries;
+    for (const auto &file : files) {
+        auto fileEntries = readCDHashes(file);
+        entries.insert(entries.end(), fileEntries.begin(), fileEntries.end());
+    }
+
+    if (output.empty()) {
+        CDHashIndex::emitText(std::cout, entries);
+        return 0;
+    }
+
+    std::ofstream out{output, std::ios::binary | std::ios::trunc};
+    if (!out.is_open()) {
+        throw std::runtime_error{"Failed opening output file: '" + output + "'"};
+    }
+    CDHashIndex::emit(out, entries);
+    if (!out.flush()) {
+        throw std::runtime_error{"Failed writing '" + output + "'"};
+    }
+    return 0;
+}
+
+int Commands::cdhashLookup(const std::string &index, const std::vector<std::string> &cdhashes) {
+    std::ifstream in{index, std::ios::binary};
+    if (!in.is_open()) {
+        throw std::runtime_error{"Failed opening cdhash index: '" + index + "'"};
+    }
+
+    int status = 0;
+    for (const auto &hex : cdhashes) {
+        auto entries = CDHashIndex::lookup(in, CDHash::fromHex(hex));
+        if (entries.empty()) {
+            status = 1;
+        }
+        CDHashIndex::emitText(std::cout, entries);
+    }
+    return status;
+}
+
+int Commands::diff(const std::string &a, const std::string &b) {
+    Manifest manifestA = Manifest::load(a);
+    Manifest manifestB = Manifest::load(b);
+    ManifestDiff diff = diffManifests(manifestA, manifestB);
+
+    for (const auto &range : diff.changed) {
+        std::cout << cpuTypeName(range.cpuType, range.cpuSubType)
+                  << " pages " << range.firstPage << "-" << range.firstPage + range.pageCount - 1
+                  << std::hex
+                  << " bytes 0x" << range.firstPage * range.pageSize
+                  << "-0x" << (range.firstPage + range.pageCount) * range.pageSize
+                  << std::dec << std::endl;
+    }
+    for (const auto &slice : diff.onlyInA) {
+        std::cout << cpuTypeName(slice->cpuType, slice->cpuSubType) << " only in " << a << std::endl;
+    }
+    for (const auto &slice : diff.onlyInB) {
+        std::cout << cpuTypeName(slice->cpuType, slice->cpuSubType) << " only in " << b << std::endl;
+    }
+
+    return diff.empty() ? 0 : 1;
+}
+
+static char **toSpawnArgs(const std::vector<std::string> &args) {
+    char **spawnArgs = reinterpret_cast<char **>(
+            calloc(args.size() + 1, sizeof(char *)));
+    for (int i = 0; i < args.size(); i++) {
+        spawnArgs[i] = strdup(args[i].c_str());
+    }
+    spawnArgs[args.size()] = nullptr;
+    return spawnArgs;
+}
+
+static void freeArgs(char **spawnArgs, std::vector<std::string>::size_type size) {
+    for (int i = 0; i < size; i++) {
+        free(spawnArgs[i]);
+    }
+    free(spawnArgs);
+}
+
+static std::string inferIdentifier(const std::string& filename) {
+    // basename / basename_r are awkward to use. We don't need the exact
+    // meaning of basename.
+
+    const auto slash = filename.find_last_of('/');
+    if (slash == std::string::npos) {
+        return filename;
+    }
+    std::string basename = filename.substr(slash + 1);
+    if (basename.empty()) {
+        return filename;
+    }
+    return basename;
+}
+
+static std::string directoryOf(const std::string &filename) {
+    const auto slash = filename.find_last_of('/');
+    if (slash == std::string::npos) {
+        return ".";
+    }
+    if (slash == 0) {
+        return "/";
+    }
+    return filename.substr(0, slash);
+}
+
+// Copy length bytes at inOffset in in to outOffset in out. Whole blocks are
+// cloned where the filesystem shares extents, and the rest is left to
+// copy_file_range, with plain reads and writes as the fallback for both.
+static void copyExtent(int in, off_t inOffset, int out, off_t outOffset, uint64_t length) {
+#ifdef __linux__
+    struct stat outStat{};
+    if (fstat(out, &outStat) == 0 && outStat.st_blksize > 0) {
+        uint64_t block = outStat.st_blksize;
+        uint64_t aligned = length / block * block;
+        if (aligned > 0 && inOffset % block == 0 && outOffset % block == 0) {
+            struct file_clone_range range{in, (uint64_t) inOffset, aligned, (uint64_t) outOffset};
+            if (ioctl(out, FICLONERANGE, &range) == 0) {
+                inOffset += aligned;
+                outOffset += aligned;
+                length -= aligned;
+            }
+        }
+    }
+
+    while (length > 0) {
+        size_t chunk = std::min<uint64_t>(length, 1 << 20);
+        Governor::shared().throttleIO(2 * chunk);
+        loff_t from = inOffset, to = outOffset;
+        ssize_t n = copy_file_range(in, &from, out, &to, chunk, 0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL) {
+                break;
+            }
+            throw std::runtime_error{std::string{"copying file: "} + strerror(errno)};
+        }
+        if (n == 0) {
+            return;
+        }
+        inOffset += n;
+        outOffset += n;
+        length -= n;
+    }
+#endif
+
+    char buf[1 << 16];
+    while (length > 0) {
+        ssize_t n = pread(in, buf, std::min<uint64_t>(length, sizeof(buf)), inOffset);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error{std::string{"copying file: "} + strerror(errno)};
+        }
+        if (n == 0) {
+            break;
+        }
+        Governor::shared().throttleIO(n);
+        writeAll(out, std::string(buf, n), outOffset);
+        inOffset += n;
+        outOffset += n;
+        length -= n;
+    }
+}
+
+// As copyExtent, but holes in the source are left as holes in out rather
+// than written out as zeros, which copy_file_range does on some filesystems
+static void copyRange(int in, off_t inOffset, int out, off_t outOffset, uint64_t length) {
+    struct stat outStat{};
+    if (fstat(out, &outStat) != 0) {
+        throw std::runtime_error{std::string{"copying file: "} + strerror(errno)};
+    }
+    if ((uint64_t) outStat.st_size < outOffset + length && ftruncate(out, outOffset + length) != 0) {
+        throw std::runtime_error{std::string{"ftruncate: "} + strerror(errno)};
+    }
+
+    DataExtents extents{in, (uint64_t) inOffset, inOffset + length};
+    for (const auto &data : extents.dataWithin(inOffset, inOffset + length)) {
+        copyExtent(in, data.first, out, outOffset + (data.first - inOffset), data.second - data.first);
+    }
+}
+
+// Copy all of in to out, starting at outOffset in out
+static void copyFileContents(int in, int out, off_t outOffset = 0) {
+    struct stat inStat{};
+    if (fstat(in, &inStat) != 0) {
+        throw std::runtime_error{std::string{"copying file: "} + strerror(errno)};
+    }
+    copyRange(in, 0, out, outOffset, inStat.st_size);
+}
+
+static void injectSignatures(const Commands::SignOptions &options, const MachOList &list, int fd) {
+    for (const auto &macho : list.machos) {
+        injectMachO(options, macho, fd);
+    }
+}
+
+// Overwrite the existing signature reservations directly. Nothing is
+// written until every slice is signed, but a crash while writing leaves a
+// file with an invalid signature.
+static void resignInPlace(const Commands::SignOptions &options, const MachOList &list) {
+    const std::string &filename = options.filename;
+    int fd = open(filename.c_str(), O_WRONLY);
+    if (fd == -1) {
+        throw std::runtime_error{std::string{"opening "} + filename + " for write: " + strerror(errno)};
+    }
+
+    try {
+        signInPlace(options, list, fd);
+    } catch (...) {
+        close(fd);
+        throw;
+    }
+
+    if (close(fd) != 0) {
+        throw std::runtime_error{std::string{"close: "} + strerror(errno)};
+    }
+}
+
+// A temporary file in the directory of target, written in full before
+// commit() renames it over target. Until then, including when anything
+// throws first, it is closed and removed. Where supported it is an
+// anonymous O_TMPFILE, only given a name on commit, so that a crash leaves
+// nothing behind; named asks for a name from the start, for other
+// processes to write to.
+class ReplacementFile {
+public:
+    ReplacementFile(const std::string &target, mode_t mode, bool named = false) : target(target) {
+#ifdef O_TMPFILE
+        if (!named) {
+            descriptor = open(directoryOf(target).c_str(), O_TMPFILE | O_RDWR, mode & 07777);
+        }
+#endif
+        if (descriptor == -1) {
+            tempfileName = target + ".sigtool-XXXXXX";
+            descriptor = mkstemp(&tempfileName[0]);
+            if (descriptor == -1) {
+                tempfileName.clear();
+                throw std::runtime_error{std::string{"creating temporary file: "} + strerror(errno)};
+            }
+        }
+
+        if (fchmod(descriptor, mode) != 0) {
+            discard();
+            throw std::runtime_error{"chmod temporary file"};
+        }
+    }
+
+    ~ReplacementFile() {
+        if (!committed) {
+            discard();
+        }
+    }
+
+    ReplacementFile(const ReplacementFile &) = delete;
+    ReplacementFile &operator=(const ReplacementFile &) = delete;
+
+    int fd() const {
+        return descriptor;
+    }
+
+    // Empty until committed if the file is anonymous
+    const std::string &name() const {
+        return tempfileName;
+    }
+
+    // Open the file at name() again, after another process replaced it
+    void reopen() {
+        close(descriptor);
+        descriptor = open(tempfileName.c_str(), O_RDWR);
+        if (descriptor == -1) {
+            throw std::runtime_error{std::string{"opening "} + tempfileName + ": " + strerror(errno)};
+        }
+    }
+
+    // Flush the contents to disk and replace the target
+    void commit() {
+        if (fsync(descriptor) != 0) {
+            throw std::runtime_error{std::string{"fsync: "} + strerror(errno)};
+        }
+
+        if (tempfileName.empty()) {
+            // linkat cannot replace an existing file, so give the temporary
+            // a unique name in the target directory first.
+            std::string procPath = "/proc/self/fd/" + std::to_string(descriptor);
+            for (unsigned int attempt = 0; ; attempt++) {
+                std::string name = target + ".sigtool-" + std::to_string(getpid()) + "-" + std::to_string(attempt);
+                if (linkat(AT_FDCWD, procPath.c_str(), AT_FDCWD, name.c_str(), AT_SYMLINK_FOLLOW) == 0) {
+                    tempfileName = name;
+                    break;
+                }
+                if (errno != EEXIST) {
+                    throw std::runtime_error{std::string{"linkat: "} + strerror(errno)};
+                }
+            }
+        }
+
+        int fd = descriptor;
+        descriptor = -1;
+        if (close(fd) != 0) {
+            throw std::runtime_error{std::string{"close: "} + strerror(errno)};
+        }
+
+        SIGTOOL_PROBE2(rename, tempfileName.c_str(), target.c_str());
+        if (rename(tempfileName.c_str(), target.c_str()) != 0) {
+            throw std::runtime_error{std::string{"rename: "} + strerror(errno)};
+        }
+        committed = true;
+    }
+
+private:
+    std::string target;
+    std::string tempfileName;
+    int descriptor = -1;
+    bool committed = false;
+
+    void discard() {
+        if (descriptor != -1) {
+            close(descriptor);
+            descriptor = -1;
+        }
+        if (!tempfileName.empty()) {
+            unlink(tempfileName.c_str());
+        }
+    }
+};
+
+// Write the new signatures into a copy of the file, and atomically replace
+// the original.
+static void resignThroughCopy(const Commands::SignOptions &options, const MachOList &list) {
+    const std::string &filename = options.filename;
+    int source = open(filename.c_str(), O_RDONLY);
+    struct stat sourceFileStat{};
+    if (source == -1 || fstat(source, &sourceFileStat) != 0) {
+        if (source != -1) {
+            close(source);
+        }
+        throw std::runtime_error{std::string{"opening "} + filename + " for read: " + strerror(errno)};
+    }
+
+    try {
+        ReplacementFile replacement{filename, sourceFileStat.st_mode};
+        copyFileContents(source, replacement.fd());
+        injectSignatures(options, list, replacement.fd());
+        replacement.commit();
+    } catch (...) {
+        close(source);
+        throw;
+    }
+    close(source);
+}
+
+// log2 of the alignment of a slice within a universal file, as lipo has it
+static uint32_t sliceAlignment(const MachOHeader &header) {
+    return (header.cpuType & ~CPUTYPE_64_BIT) == CPUTYPE_ARM ? 14 : 12;
+}
+
+// A slice of a universal file being written
+struct FatSlice {
+    uint32_t cpuType;
+    uint32_t cpuSubType;
+    uint64_t size;
+    // log2
+    uint32_t align;
+    // Set by layoutUniversal
+    uint64_t offset;
+};
+
+// Place the slices after the universal header, each at its alignment, and
+// return the header. The 64-bit header is only used when an offset or size
+// does not fit 32 bits.
+static std::string layoutUniversal(std::vector<FatSlice> &slices) {
+    bool fat64 = false;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        uint64_t end = 2 * sizeof(uint32_t) + slices.size() * (fat64 ? 32 : 20);
+        bool fits = true;
+        for (auto &slice : slices) {
+            uint64_t alignment = uint64_t{1} << slice.align;
+            slice.offset = (end + alignment - 1) & ~(alignment - 1);
+            end = slice.offset + slice.size;
+            fits = fits && end <= std::numeric_limits<uint32_t>::max();
+        }
+        if (fits || fat64) {
+            break;
+        }
+        fat64 = true;
+    }
+
+    std::ostringstream header;
+    EmitBE::writeUInt32(header, fat64 ? MH_FAT_MAGIC_64 : MH_FAT_MAGIC);
+    EmitBE::writeUInt32(header, slices.size());
+    for (const auto &slice : slices) {
+        EmitBE::writeUInt32(header, slice.cpuType);
+        EmitBE::writeUInt32(header, slice.cpuSubType);
+        if (fat64) {
+            EmitBE::writeUInt64(header, slice.offset);
+            EmitBE::writeUInt64(header, slice.size);
+            EmitBE::writeUInt32(header, slice.align);
+            EmitBE::writeUInt32(header, 0); // reserved
+        } else {
+            EmitBE::writeUInt32(header, slice.offset);
+            EmitBE::writeUInt32(header, slice.size);
+            EmitBE::writeUInt32(header, slice.align);
+        }
+    }
+    return header.str();
+}
+
+// A slice as codesign_allocate lays it out for a signature reservation:
+// its new header and load commands, how much of the original slice is kept
+// ahead of the reservation, and its new size
+struct SliceAllocation {
+    std::string headers;
+    uint64_t kept;
+    uint64_t size;
+};
+
+// Overwrite the bytes at offset with value, as laid out in the file
+template<typename T>
+static void patchBytes(std::string &bytes, uint64_t offset, const T &value) {
+    std::ostringstream buf;
+    Emit::writeBytes(buf, value);
+    bytes.replace(offset, sizeof(T), buf.str());
+}
+
+// Give the slice a reservation of the requested size at the end of
+// __LINKEDIT, growing an existing LC_CODE_SIGNATURE or adding one in the
+// padding after the load commands. Returns false for layouts left to
+// codesign_allocate: __LINKEDIT not the last segment, a signature which
+// does not end it, or no free padding.
+static bool allocateSlice(int source, const std::shared_ptr<MachO> &macho, uint32_t reservation,
+                          SliceAllocation &allocation) {
+    constexpr uint32_t commandHeaderSize = 2 * sizeof(uint32_t);
+    constexpr uint32_t codeSignatureSize = commandHeaderSize + sizeof(CodeSignatureLoadCommand::data);
+
+    // Read the padding a new load command would take as well
+    uint64_t commandsEnd = sizeof(uint32_t) + sizeof(MachOHeader) + macho->header.sizeOfCmds;
+    std::string headers(std::min<uint64_t>(commandsEnd + codeSignatureSize, macho->size), '\0');
+    if (headers.size() < commandsEnd ||
+        pread(source, &headers[0], headers.size(), macho->offset) != (ssize_t) headers.size()) {
+        return false;
+    }
+
+    auto linkedit = macho->getSegment64LoadCommand("__LINKEDIT");
+    if (!linkedit || linkedit->offset + commandHeaderSize + sizeof(linkedit->data) > commandsEnd) {
+        return false;
+    }
+
+    uint64_t segmentsEnd = 0, firstSection = std::numeric_limits<uint64_t>::max();
+    for (const auto &segment : macho->getSegment64LoadCommands()) {
+        segmentsEnd = std::max(segmentsEnd, segment->data.fileoff + segment->data.filesize);
+        if (segment->sections.size() != segment->data.nsects) {
+            return false;
+        }
+        for (const auto &section : segment->sections) {
+            // Zero fill sections have no contents in the file
+            uint32_t type = section.flags & SECTION_TYPE;
+            bool zerofill = type == S_ZEROFILL || type == S_GB_ZEROFILL || type == S_THREAD_LOCAL_ZEROFILL;
+            if (section.offset != 0 && !zerofill) {
+                firstSection = std::min<uint64_t>(firstSection, section.offset);
+            }
+        }
+    }
+
+    uint64_t linkeditStart = linkedit->data.fileoff;
+    uint64_t linkeditEnd = linkeditStart + linkedit->data.filesize;
+    if (linkeditEnd != segmentsEnd) {
+        return false;
+    }
+
+    uint64_t dataOff;
+    auto codeSignature = macho->getCodeSignatureLoadCommand();
+    if (codeSignature) {
+        // The reservation grows into whatever follows it in __LINKEDIT, so
+        // it has to be the last thing there
+        dataOff = codeSignature->data.dataOff;
+        if (dataOff < linkeditStart || dataOff + codeSignature->data.dataSize != linkeditEnd ||
+            codeSignature->offset + codeSignatureSize > commandsEnd) {
+            return false;
+        }
+        headers.resize(commandsEnd);
+
+        auto data = codeSignature->data;
+        data.dataSize = reservation;
+        patchBytes(headers, codeSignature->offset + commandHeaderSize, data);
+    } else {
+        if (commandsEnd + codeSignatureSize > firstSection || headers.size() < commandsEnd + codeSignatureSize ||
+            headers.find_first_not_of('\0', commandsEnd) != std::string::npos) {
+            return false;
+        }
+        dataOff = (linkeditEnd + 0xf) & ~uint64_t{0xf};
+
+        CodeSignatureLoadCommand command{LC_CODE_SIGNATURE, codeSignatureSize};
+        command.data.dataOff = dataOff;
+        command.data.dataSize = reservation;
+        patchBytes(headers, commandsEnd, command.type);
+        patchBytes(headers, commandsEnd + sizeof(uint32_t), command.cmdSize);
+        patchBytes(headers, commandsEnd + commandHeaderSize, command.data);
+
+        MachOHeader header = macho->header;
+        header.nCommands++;
+        header.sizeOfCmds += codeSignatureSize;
+        patchBytes(headers, sizeof(uint32_t), header);
+    }
+    if (dataOff + reservation > std::numeric_limits<uint32_t>::max()) {
+        return false;
+    }
+
+    // __LINKEDIT ends with the reservation, and is mapped in whole pages
+    uint64_t pageMask = (uint64_t{1} << sliceAlignment(macho->header)) - 1;
+    auto segment = linkedit->data;
+    segment.filesize = dataOff + reservation - linkeditStart;
+    segment.vmsize = std::max(segment.vmsize, (segment.filesize + pageMask) & ~pageMask);
+    patchBytes(headers, linkedit->offset + commandHeaderSize, segment);
+
+    allocation.headers = headers;
+    allocation.kept = std::min<uint64_t>(dataOff, macho->size);
+    allocation.size = dataOff + reservation;
+    return true;
+}
+
+// Write out with a signature reservation of the requested size in each
+// slice, without codesign_allocate. Only the headers are written; the rest
+// of each slice is shared with or copied from the source, and the
+// reservations are left as holes. Returns false, having written nothing,
+// if any slice needs codesign_allocate.
+static bool allocateNatively(int source, const MachOList &list, const std::vector<uint32_t> &reservations, int out) {
+    std::vector<SliceAllocation> allocations(list.machos.size());
+    for (size_t i = 0; i < list.machos.size(); i++) {
+        if (!allocateSlice(source, list.machos[i], reservations[i], allocations[i])) {
+            return false;
+        }
+    }
+
+    // Universal files are laid out again, as slices may have grown
+    std::vector<FatSlice> layout;
+    std::string universalHeader;
+    if (list.machos.size() == 1 && list.machos[0]->offset == 0) {
+        layout.push_back(FatSlice{0, 0, allocations[0].size, 0, 0});
+    } else {
+        for (size_t i = 0; i < list.machos.size(); i++) {
+            const auto &header = list.machos[i]->header;
+            layout.push_back(FatSlice{header.cpuType, header.cpuSubType, allocations[i].size,
+                                      sliceAlignment(header), 0});
+        }
+        universalHeader = layoutUniversal(layout);
+    }
+
+    if (ftruncate(out, layout.back().offset + layout.back().size) != 0) {
+        throw std::runtime_error{std::string{"ftruncate: "} + strerror(errno)};
+    }
+    if (!universalHeader.empty()) {
+        writeAll(out, universalHeader, 0);
+    }
+    for (size_t i = 0; i < list.machos.size(); i++) {
+        copyRange(source, list.machos[i]->offset, out, layout[i].offset, allocations[i].kept);
+        writeAll(out, allocations[i].headers, layout[i].offset);
+    }
+
+    return true;
+}
+
+// Check, without hashing any pages, that the embedded signature of a thin
+// file is consistent with the file around it
+static void checkSignatureIntact(const std::string &filename, const std::shared_ptr<MachO> &macho) {
+    auto codeSignature = macho->getCodeSignatureLoadCommand();
+    if (!codeSignature) {
+        throw std::runtime_error{filename + ": not signed"};
+    }
+    if ((uint64_t) codeSignature->data.dataOff + codeSignature->data.dataSize > macho->size) {
+        throw std::runtime_error{filename + ": signature extends beyond the end of the file"};
+    }
+
+    std::ifstream machoFileRaw = openMachO(filename);
+    SuperBlob sb{};
+    try {
+        sb = SuperBlob::parse(macho->readCodeSignatureData(machoFileRaw));
+    } catch (std::runtime_error &e) {
+        throw std::runtime_error{filename + ": " + e.what()};
+    }
+
+    auto codeDirectory = sb.codeDirectory();
+    if (!codeDirectory) {
+        throw std::runtime_error{filename + ": signature has no code directory"};
+    }
+
+    const auto &data = codeDirectory->data;
+    if (codeDirectory->codeLimit() != codeSignature->data.dataOff) {
+        throw std::runtime_error{filename + ": code directory does not cover the code up to the signature"};
+    }
+    if (data.pageSize == 0 || data.pageSize > 16 ||
+        codeDirectory->codeHashes.size() !=
+        (codeDirectory->codeLimit() + (uint64_t{1} << data.pageSize) - 1) >> data.pageSize) {
+        throw std::runtime_error{filename + ": code directory has the wrong number of page hashes"};
+    }
+
+    auto textSegment = macho->getSegment64LoadCommand("__TEXT");
+    if (textSegment && data.execSegLimit != 0 &&
+        (data.execSegBase != textSegment->data.fileoff ||
+         data.execSegLimit != textSegment->data.fileoff + textSegment->data.filesize)) {
+        throw std::runtime_error{filename + ": code directory does not match the __TEXT segment"};
+    }
+}
+
+int Commands::merge(const std::string &output, const std::vector<std::string> &inputs) {
+    struct Slice {
+        std::string filename;
+        std::shared_ptr<MachO> macho;
+    };
+
+    std::vector<Slice> slices;
+    for (const auto &input : inputs) {
+        MachOList list{input};
+        if (list.machos.size() != 1 || list.machos[0]->offset != 0) {
+            throw std::runtime_error{input + ": already a universal file"};
+        }
+
+        const auto &macho = list.machos[0];
+        for (const auto &slice : slices) {
+            if (slice.macho->header.cpuType == macho->header.cpuType &&
+                slice.macho->header.cpuSubType == macho->header.cpuSubType) {
+                throw std::runtime_error{input + " and " + slice.filename + " have the same architecture"};
+            }
+        }
+
+        checkSignatureIntact(input, macho);
+        slices.push_back(Slice{input, macho});
+    }
+
+    if (slices.empty()) {
+        throw std::runtime_error{"nothing to merge"};
+    }
+
+    std::vector<FatSlice> layout;
+    for (const auto &slice : slices) {
+        layout.push_back(FatSlice{slice.macho->header.cpuType, slice.macho->header.cpuSubType,
+                                  slice.macho->size, sliceAlignment(slice.macho->header), 0});
+    }
+    std::string header = layoutUniversal(layout);
+
+    struct stat sourceFileStat{};
+    if (stat(slices[0].filename.c_str(), &sourceFileStat) != 0) {
+        throw std::runtime_error{std::string{"stat of "} + slices[0].filename + " failed: " + strerror(errno)};
+    }
+
+    ReplacementFile replacement{output, sourceFileStat.st_mode};
+
+    // Slices are copied whole, signatures included; the gaps between
+    // them are left as holes.
+    writeAll(replacement.fd(), header, 0);
+    for (size_t i = 0; i < slices.size(); i++) {
+        const auto &slice = slices[i];
+        int in = open(slice.filename.c_str(), O_RDONLY);
+        if (in == -1) {
+            throw std::runtime_error{std::string{"opening "} + slice.filename + ": " + strerror(errno)};
+        }
+        try {
+            copyFileContents(in, replacement.fd(), layout[i].offset);
+        } catch (...) {
+            close(in);
+            throw;
+        }
+        close(in);
+    }
+
+    replacement.commit();
+
+    return 0;
+}
+
+std::vector<Commands::SignVariant> Commands::parseVariants(std::istream &is) {
+    std::vector<SignVariant> variants;
+    std::string line;
+    unsigned int lineNumber = 0;
+
+    while (std::getline(is, line)) {
+        lineNumber++;
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+
+        std::istringstream fields{line};
+        SignVariant variant{};
+        std::string rest;
+        if (!(fields >> variant.identifier >> variant.entitlements >> variant.output) || fields >> rest) {
+            throw std::runtime_error{"malformed variant on line " + std::to_string(lineNumber) + ": " + line};
+        }
+        if (variant.entitlements == "-") {
+            variant.entitlements.clear();
+        }
+
+        variants.push_back(variant);
+    }
+
+    return variants;
+}
+
+// Copy the source to output with the given signatures injected, through a
+// temporary file which replaces output once complete
+static void writeSignedCopy(int source, mode_t mode, const std::string &output, const MachOList &list,
+                            std::vector<SuperBlob> &signatures) {
+    ReplacementFile replacement{output, mode};
+    copyFileContents(source, replacement.fd());
+    writeSignatures(replacement.fd(), list, signatures);
+    replacement.commit();
+}
+
+int Commands::signVariants(const SignOptions &options, const std::vector<SignVariant> &variants, bool emit) {
+    MachOList list{options.filename};
+
+    // Page hashes depend only on the file contents, so each slice is hashed
+    // once and its hashes shared by the code directory of every variant
+    std::vector<std::vector<Hash>> codeHashes;
+    {
+        std::ifstream in = openMachO(options.filename);
+        for (const auto &macho : list.machos) {
+            DataExtents extents{options.filename, (uint64_t) macho->offset, macho->offset + codeLimitOf(macho)};
+            auto codeDirectory = prepareCodeDirectory(options, macho);
+            hashPages(options, in, macho, [&](const Hash &hash) { codeDirectory->addCodeHash(hash); }, &extents);
+            codeHashes.push_back(std::move(codeDirectory->codeHashes));
+        }
+    }
+
+    int source = -1;
+    struct stat sourceFileStat{};
+    if (!emit) {
+        for (const auto &macho : list.machos) {
+            if (!macho->getCodeSignatureLoadCommand()) {
+                throw std::runtime_error{"cannot inject variants without an LC_CODE_SIGNATURE reservation"};
+            }
+        }
+        source = open(options.filename.c_str(), O_RDONLY);
+        if (source == -1 || fstat(source, &sourceFileStat) != 0) {
+            throw std::runtime_error{std::string{"opening "} + options.filename + ": " + strerror(errno)};
+        }
+    }
+
+    try {
+        for (const auto &variant : variants) {
+            SignOptions variantOptions = options;
+            variantOptions.identifier = variant.identifier;
+            variantOptions.entitlements = variant.entitlements;
+
+            std::vector<SuperBlob> signatures;
+            for (size_t i = 0; i < list.machos.size(); i++) {
+                SuperBlob sb{};
+                auto codeDirectory = prepareCodeDirectory(variantOptions, list.machos[i]);
+                for (const auto &hash : codeHashes[i]) {
+                    codeDirectory->addCodeHash(hash);
+                }
+                sb.blobs.push_back(codeDirectory);
+                addSpecialBlobs(variantOptions, codeDirectory, sb);
+                signatures.push_back(std::move(sb));
+            }
+
+            if (!emit) {
+                writeSignedCopy(source, sourceFileStat.st_mode, variant.output, list, signatures);
+                continue;
+            }
+
+            std::ofstream out{variant.output, std::ios::binary | std::ios::trunc};
+            if (!out.is_open()) {
+                throw std::runtime_error{"Failed opening output file: '" + variant.output + "'"};
+            }
+            for (auto &sb : signatures) {
+                sb.emit(out);
+            }
+            if (!out.flush()) {
+                throw std::runtime_error{"Failed writing '" + variant.output + "'"};
+            }
+        }
+    } catch (...) {
+        if (source != -1) {
+            close(source);
+        }
+        throw;
+    }
+
+    if (source != -1) {
+        close(source);
+    }
+
+    return 0;
+}
+
+int Commands::signArchive(const SignOptions &options, ArchiveFormat format) {
+    filterArchive(STDIN_FILENO, STDOUT_FILENO, format, [&](const std::string &path, std::string &contents) {
+        SignOptions entryOptions = options;
+        entryOptions.filename = path;
+        if (entryOptions.identifier.empty()) {
+            entryOptions.identifier = inferIdentifier(path);
+        }
+
+        MemoryStream in{contents.data(), contents.size()};
+
+        // Entries which merely look like Mach-O files, or which have no room
+        // for a signature, are passed through unchanged.
+        std::vector<std::pair<uint64_t, std::string>> patches;
+        try {
+            MachOList list{in, contents.size()};
+
+            for (const auto &macho : list.machos) {
+                if (!macho->requiresSignature()) {
+                    continue;
+                }
+                auto codeSignature = macho->getCodeSignatureLoadCommand();
+                if (!codeSignature) {
+                    std::cerr << path << ": no LC_CODE_SIGNATURE reservation, left unsigned" << std::endl;
+                    return;
+                }
+                if (entryOptions.identifier.empty()) {
+                    throw std::runtime_error{"no identifier for the archive root, pass -i"};
+                }
+
+                uint64_t offset = macho->offset + codeSignature->data.dataOff;
+                if (offset + codeSignature->data.dataSize > contents.size()) {
+                    throw std::runtime_error{"signature reservation extends beyond the file"};
+                }
+
+                in.clear();
+                auto sb = signMachO(entryOptions, macho, in);
+                patches.emplace_back(offset, signatureBytes(macho, sb));
+            }
+        } catch (NotAMachOFileException &e) {
+            return;
+        } catch (std::runtime_error &e) {
+            std::cerr << path << ": " << e.what() << ", left unsigned" << std::endl;
+            return;
+        }
+
+        for (const auto &patch : patches) {
+            contents.replace(patch.first, patch.second.size(), patch.second);
+        }
+    });
+
+    return 0;
+}
+
+// Run codesign_allocate, as named by $CODESIGN_ALLOCATE if set
+static void runCodesignAllocate(const std::vector<std::string> &arguments, const std::string &filename) {
+    pid_t pid;
+    char **spawnArgs = toSpawnArgs(arguments);
+
+    const char *codesign_allocate = getenv("CODESIGN_ALLOCATE");
+    if (!codesign_allocate) {
+        codesign_allocate = "codesign_allocate";
+    }
+
+    int spawn_result;
+    if ((spawn_result = posix_spawnp(&pid, codesign_allocate, nullptr, nullptr, spawnArgs, environ)) != 0) {
+        throw std::runtime_error{std::string{"Failed to spawn codesign_allocate: "} + strerror(spawn_result)};
+    };
+    SIGTOOL_PROBE2(allocate__spawn, filename.c_str(), pid);
+
+    int codesign_status;
+    pid_t waitpid_result;
+    do {
+        waitpid_result = waitpid(pid, &codesign_status, 0);
+    } while (waitpid_result == -1 && errno == EINTR);
+    if (waitpid_result == -1) {
+        throw std::runtime_error{
+                std::string{"codesign waitpid failed: "} + strerror(errno)
+        };
+    }
+
+    freeArgs(spawnArgs, arguments.size());
+    SIGTOOL_PROBE2(allocate__exit, filename.c_str(), codesign_status);
+
+    if (!WIFEXITED(codesign_status) || WEXITSTATUS(codesign_status) != 0) {
+        throw std::runtime_error{std::string{"codesign_failed: "} + std::to_string(WEXITSTATUS(codesign_status))};
+    }
+}
+
+int Commands::codesign(const CodesignOptions &options, const std::string &filename) {
+    struct stat targetStat{};
+    if (stat(filename.c_str(), &targetStat) == 0 && S_ISDIR(targetStat.st_mode)) {
+        return codesignBundle(options, filename);
+    }
+
+    std::string identifier = options.identifier;
+    if (identifier.empty()) {
+        identifier = inferIdentifier(filename);
+    }
+    SignOptions signOptions{
+            .filename = filename,
+            .identifier = identifier,
+            .entitlements = options.entitlements,
+            .infoPlist = options.infoPlist,
+            .resources = options.resources,
+            .cancel = options.cancel,
+    };
+
+    SigningLock lock{filename};
+
+    // Parse and discovery arguments
+    MachOList list{filename};
+
+    // Having waited for another signer, check whether it did the same work
+    SkipCheck skipCheck = options.skipIfCurrent;
+    if (lock.waited() && skipCheck == SkipCheck::Never) {
+        skipCheck = SkipCheck::Full;
+    }
+
+    if (skipCheck != SkipCheck::Never) {
+        bool current = std::all_of(list.machos.begin(), list.machos.end(), [&](const std::shared_ptr<MachO> &macho) {
+            return isSignatureCurrent(signOptions, macho, skipCheck);
+        });
+        if (current) {
+            // Leave the file untouched, including its modification time.
+            return 0;
+        }
+    }
+    std::vector<std::string> arguments;
+
+    arguments.emplace_back("codesign_allocate");
+    arguments.emplace_back("-i");
+    arguments.emplace_back(filename);
+
+
+    std::vector<uint32_t> reservations;
+    bool fitsExistingReservation = true;
+
+    for (const auto &macho : list.machos) {
+        auto codeSignature = macho->getCodeSignatureLoadCommand();
+        if (!options.force && codeSignature) {
+            throw std::runtime_error{"file is already signed. pass -f to sign regardless."};
+        }
+        auto sb = prepareSignature(signOptions, macho);
+
+        if (!codeSignature || sb.length() > codeSignature->data.dataSize) {
+            fitsExistingReservation = false;
+        }
+
+        arguments.emplace_back("-A");
+        arguments.emplace_back(std::to_string(macho->header.cpuType));
+        arguments.emplace_back(std::to_string(macho->header.cpuSubType & ~CPU_SUBTYPE_MASK));
+
+        size_t len = sb.length();
+        len = ((len + 0xf) & ~0xf) + 1024; // align and pad
+        arguments.push_back(std::to_string(len));
+        reservations.push_back(len);
+    }
+
+    // Re-signing where every slice's existing reservation can hold the new
+    // signature needs no reallocation: overwrite the signatures where they are.
+    if (fitsExistingReservation) {
+        if (options.atomic) {
+            resignThroughCopy(signOptions, list);
+        } else {
+            resignInPlace(signOptions, list);
+        }
+        return 0;
+    }
+
+    // Preserve mode
+    struct stat sourceFileStat{};
+    if (stat(filename.c_str(), &sourceFileStat) != 0) {
+        throw std::runtime_error{std::string{"stat of "} + filename + " failed: " + strerror(errno)};
+    }
+
+    // Named, as codesign_allocate may have to write it
+    ReplacementFile replacement{filename, sourceFileStat.st_mode, true};
+
+    // Write the body of the copy ourselves where the layout allows, so that
+    // on filesystems sharing extents only the changed headers take space
+    int source = open(filename.c_str(), O_RDONLY);
+    if (source == -1) {
+        throw std::runtime_error{std::string{"opening "} + filename + " for read: " + strerror(errno)};
+    }
+    bool allocated;
+    try {
+        allocated = allocateNatively(source, list, reservations, replacement.fd());
+    } catch (...) {
+        close(source);
+        throw;
+    }
+    close(source);
+
+    if (!allocated) {
+        arguments.emplace_back("-o");
+        arguments.emplace_back(replacement.name());
+
+        // codesign_allocate reads the file and writes a copy, at its own pace;
+        // charge for that up front
+        Governor::shared().throttleIO(2 * (uint64_t) sourceFileStat.st_size);
+        runCodesignAllocate(arguments, filename);
+        replacement.reopen();
+    }
+
+    // The copy is not renamed into place yet, so the hashes can be streamed
+    // into it
+    signOptions.filename = replacement.name();
+    MachOList allocatedList{replacement.name()};
+    injectSignatures(signOptions, allocatedList, replacement.fd());
+
+    replacement.commit();
 
     return 0;
 }
@@ -1,7 +1,14 @@
 #ifndef SIGTOOL_COMMANDS_H
 #define SIGTOOL_COMMANDS_H
 
+#include <atomic>
+#include <cstdint>
+#include <istream>
+#include <stdexcept>
 #include <string>
+#include <vector>
+
+#include "cdhash.h"
 
 namespace SigTool {
 namespace Commands {
@@ -9,20 +16,146 @@ namespace Commands {
         std::string filename;
         std::string identifier;
         std::string entitlements;
+        // Files hashed into the Info.plist and resource directory special slots
+        std::string infoPlist;
+        std::string resources;
+        // When set, page hashing stops between batches by throwing Cancelled
+        const std::atomic<bool> *cancel;
+    };
+
+    // Thrown when signing or verification is cancelled through the options
+    struct Cancelled : public std::runtime_error {
+        Cancelled() : std::runtime_error{"cancelled"} {}
+    };
+
+    // How much of an existing signature's page hashes to verify before
+    // deciding that a file is already correctly signed.
+    enum class SkipCheck {
+        Never,
+        Sample,
+        Full,
     };
 
     struct CodesignOptions {
         std::string identifier;
         std::string entitlements;
         bool force;
+        // When re-signing within the existing reservation, write through a
+        // temporary copy which replaces the original, rather than in place.
+        bool atomic;
+        // Leave files which already carry the requested signature untouched
+        SkipCheck skipIfCurrent;
+        std::string infoPlist;
+        std::string resources;
+        // Worker threads for bundle signing, 0 for one per hardware thread
+        unsigned int jobs;
+        const std::atomic<bool> *cancel;
+    };
+
+    struct WatchOptions {
+        std::string directory;
+        // Identifier for every signed file, inferred from the filename if empty
+        std::string identifier;
+        std::string entitlements;
+        // Worker threads, 0 for one per hardware thread
+        unsigned int jobs;
+        // Quiet period after the last write before a file is signed
+        unsigned int debounceMs;
+    };
+
+    // Container format of a stream passed to signArchive
+    enum class ArchiveFormat {
+        Auto,
+        NAR,
+        Tar,
+    };
+
+    // Where generate puts the signature of each slice. By default they are
+    // concatenated on stdout.
+    struct GenerateOptions {
+        // Write <arch>.sig per slice into this directory, and list them on stdout
+        std::string outputDir;
+        // Emit an indexed container on stdout
+        bool indexed;
+    };
+
+    // Indexed container layout, all big endian:
+    //   magic, version, count
+    //   count * { cpuType, cpuSubType, sliceOffset (64), signatureOffset (64),
+    //             dataOffset, length }
+    //   signature data
+    // signatureOffset is where the slice's LC_CODE_SIGNATURE data begins in the
+    // target file, or 0 if it has no reservation. dataOffset is relative to the
+    // start of the container.
+    constexpr const uint32_t indexedMagic = 0x73696769; // 'sigi'
+    constexpr const uint32_t indexedEntrySize = 4 * sizeof(uint32_t) + 2 * sizeof(uint64_t);
+
+    // A modified region of a file, in absolute file offsets
+    struct ByteRange {
+        uint64_t offset;
+        uint64_t length;
+    };
+
+    // Parse "offset length" lines, in decimal or 0x-prefixed hex
+    std::vector<ByteRange> parseByteRanges(std::istream &is);
+
+    // One signature of a file under signVariants
+    struct SignVariant {
+        std::string identifier;
+        // Entitlements plist, empty for none
+        std::string entitlements;
+        // The signed copy, or the signature alone when emitting
+        std::string output;
     };
 
+    // Parse "identifier entitlements output" lines, with - for no entitlements
+    std::vector<SignVariant> parseVariants(std::istream &is);
+
     int checkRequiresSignature(const std::string &file);
     int showArch(const std::string &file);
     int showSize(const SignOptions& options);
+    // The length of the signature that would be generated for each slice
+    std::vector<size_t> signatureSizes(const SignOptions& options);
+    // 0 if the code hashes and embedded blobs of every slice match its
+    // signature, 1 otherwise
+    int verify(const SignOptions& options);
     int inject(const SignOptions& options);
+    // As above, collecting the cdhash of each slice's new signature
+    int inject(const SignOptions& options, std::vector<CDHashEntry>& cdhashes);
     int generate(const SignOptions& options);
+    int generate(const SignOptions& options, const GenerateOptions& generateOptions);
+    int resign(const SignOptions& options, const std::vector<ByteRange>& dirtyRanges);
+    int manifest(const std::string &file, bool json);
+    int diff(const std::string &a, const std::string &b);
+    int inspect(const std::string &file, bool json);
+
+    // Read the cdhashes of signed files, and write them as a binary index
+    // to output, or as text on stdout if output is empty
+    int cdhashIndex(const std::vector<std::string> &files, const std::string &output);
+    // Print the index entries for each cdhash; 1 if any is missing
+    int cdhashLookup(const std::string &index, const std::vector<std::string> &cdhashes);
+
+    // Sign the file under each variant, hashing its pages only once. Each
+    // output is a copy of the file with its variant's signature injected, or
+    // with emit, the concatenated signatures as generate writes them.
+    int signVariants(const SignOptions& options, const std::vector<SignVariant>& variants, bool emit);
+
+    // Build a universal file from signed thin files, keeping their
+    // signatures after checking that they are intact, without rehashing
+    int merge(const std::string &output, const std::vector<std::string> &inputs);
     int codesign(const CodesignOptions& options, const std::string& file);
+
+    // Copy an archive from stdin to stdout, signing each Mach-O entry within
+    // its existing LC_CODE_SIGNATURE reservation. The identifier is inferred
+    // from each entry's name unless one is given.
+    int signArchive(const SignOptions& options, ArchiveFormat format);
+
+    // Sign the nested code of a bundle inside-out, seal its resources in
+    // _CodeSignature/CodeResources, then sign its main executable.
+    int codesignBundle(const CodesignOptions& options, const std::string& bundle);
+
+    // Re-sign Mach-O files under a directory as they are written, until killed
+    int watch(const WatchOptions& options);
 };
 };
 
@@ -55,6 +55,12 @@ public:
     static uint32_t readUInt32(std::istream& is) {
         return ntohl(Read::readBytes<uint32_t>(is));
     }
+
+    static uint64_t readUInt64(std::istream& is) {
+        uint64_t high = readUInt32(is);
+        uint64_t low = readUInt32(is);
+        return (high << 32) | low;
+    }
 };
 
 class ReadLE : public Read {
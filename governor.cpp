@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include "governor.h"
+
+namespace SigTool {
+
+// Burst allowed after the budget has gone unused for a while
+constexpr const double burstSeconds = 0.1;
+
+// PSI "some avg10" percentage above which IO counts as contended
+constexpr const double pressureThreshold = 10.0;
+constexpr const double minimumPressureScale = 1.0 / 16;
+constexpr const std::chrono::seconds pressureInterval{1};
+
+Governor &Governor::shared() {
+    static Governor governor;
+    return governor;
+}
+
+void Governor::setLimits(const Limits &limits) {
+    if (limits.cpuShare <= 0 || limits.cpuShare > 1) {
+        throw std::runtime_error{"CPU share must be in (0, 1]"};
+    }
+
+    std::lock_guard<std::mutex> lock{mutex};
+    bytesPerSecond = limits.bytesPerSecond;
+    cpuShare = limits.cpuShare;
+    psiBackoff = limits.psiBackoff;
+    tokens = 0;
+    refilled = Clock::now();
+    pressureScale = 1.0;
+}
+
+void Governor::throttleIO(uint64_t bytes) {
+    std::chrono::duration<double> wait{0};
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        if (bytesPerSecond == 0) {
+            return;
+        }
+
+        auto now = Clock::now();
+        if (psiBackoff) {
+            checkPressure(now);
+        }
+
+        double rate = bytesPerSecond * pressureScale;
+        std::chrono::duration<double> elapsed = now - refilled;
+        tokens = std::min(tokens + elapsed.count() * rate, rate * burstSeconds);
+        refilled = now;
+
+        // Take the bytes now, borrowing against future refills if need be,
+        // and wait until the debt is repaid. Later callers queue behind it.
+        tokens -= bytes;
+        if (tokens < 0) {
+            wait = std::chrono::duration<double>{-tokens / rate};
+        }
+    }
+
+    if (wait.count() > 0) {
+        std::this_thread::sleep_for(wait);
+    }
+}
+
+void Governor::throttleCPU(std::chrono::nanoseconds used) {
+    double share;
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        share = cpuShare;
+    }
+    if (share >= 1.0 || used.count() <= 0) {
+        return;
+    }
+
+    // Running for used and then idling for this long gives the share
+    std::this_thread::sleep_for(std::chrono::duration<double>{
+            std::chrono::duration<double>(used).count() * (1 - share) / share});
+}
+
+std::chrono::nanoseconds Governor::threadCPUTime() {
+    struct timespec ts{};
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return std::chrono::nanoseconds{0};
+    }
+    return std::chrono::seconds{ts.tv_sec} + std::chrono::nanoseconds{ts.tv_nsec};
+}
+
+// Halve the budget while IO is contended, and win it back a step at a time
+// once it is not. Called with the mutex held.
+void Governor::checkPressure(Clock::time_point now) {
+    if (now - pressureChecked < pressureInterval) {
+        return;
+    }
+    pressureChecked = now;
+
+    // some avg10=1.23 avg60=0.50 avg300=0.10 total=12345
+    std::ifstream psi{"/proc/pressure/io"};
+    std::string line;
+    if (!std::getline(psi, line) || line.compare(0, 5, "some ") != 0) {
+        return;
+    }
+    auto avg10 = line.find("avg10=");
+    if (avg10 == std::string::npos) {
+        return;
+    }
+    double pressure = std::strtod(line.c_str() + avg10 + 6, nullptr);
+
+    if (pressure > pressureThreshold) {
+        pressureScale = std::max(minimumPressureScale, pressureScale / 2);
+    } else {
+        pressureScale = std::min(1.0, pressureScale + 0.125);
+    }
+}
+};
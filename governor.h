@@ -0,0 +1,63 @@
+#ifndef SIGTOOL_GOVERNOR_H
+#define SIGTOOL_GOVERNOR_H
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace SigTool {
+
+// Paces the signing pipeline of the whole process, so that bulk signing on
+// a shared machine leaves room for other work. Reads and writes draw from a
+// token bucket refilled at the byte budget, and hashing threads sleep in
+// proportion to the CPU time they use. With PSI backoff, the byte budget is
+// halved while /proc/pressure/io reports contention and recovers gradually
+// once it clears.
+class Governor {
+public:
+    struct Limits {
+        // Read and write budget, 0 for no limit
+        uint64_t bytesPerSecond;
+        // Fraction of each hashing thread's time spent on the CPU, in (0, 1]
+        double cpuShare;
+        // Scale the byte budget by IO pressure stall information
+        bool psiBackoff;
+    };
+
+    // The governor consulted by the signing pipeline, unlimited until set
+    static Governor &shared();
+
+    void setLimits(const Limits &limits);
+
+    // Account for bytes about to be read or written, sleeping as long as
+    // needed to stay within the budget
+    void throttleIO(uint64_t bytes);
+
+    // Account for CPU time just used by the calling thread, sleeping long
+    // enough to keep it within its share
+    void throttleCPU(std::chrono::nanoseconds used);
+
+    // CPU time used by the calling thread so far
+    static std::chrono::nanoseconds threadCPUTime();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    std::mutex mutex;
+    uint64_t bytesPerSecond = 0;
+    double cpuShare = 1.0;
+    bool psiBackoff = false;
+
+    // Available bytes, negative when a large request has borrowed ahead
+    double tokens = 0;
+    Clock::time_point refilled = Clock::now();
+
+    // Current fraction of the byte budget, as adjusted by PSI
+    double pressureScale = 1.0;
+    Clock::time_point pressureChecked;
+
+    void checkPressure(Clock::time_point now);
+};
+};
+
+#endif // SIGTOOL_GOVERNOR_H
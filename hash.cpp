@@ -1,9 +1,23 @@
+#include <openssl/evp.h>
 #include <openssl/sha.h>
+#include <stdexcept>
 
 #include "hash.h"
 
 namespace SigTool {
 
+std::string toHex(const char *bytes, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(2 * len);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char byte = bytes[i];
+        out.push_back(digits[byte >> 4]);
+        out.push_back(digits[byte & 0xf]);
+    }
+    return out;
+}
+
 SHA256Hash::SHA256Hash(const char *data, size_t len)
   : SHA256Hash(reinterpret_cast<const unsigned char*>(data), len)
 {}
@@ -15,4 +29,57 @@ SHA256Hash::SHA256Hash(const std::string& str)
 SHA256Hash::SHA256Hash(const unsigned char *data, size_t len) {
     SHA256(data, len, reinterpret_cast<unsigned char *>(&this->bytes[0]));
 }
+
+std::string SHA256Hash::hex() const {
+    return toHex(bytes, hashSize);
+}
+
+SHA1Hash::SHA1Hash(const char *data, size_t len) {
+    SHA1(reinterpret_cast<const unsigned char*>(data), len, reinterpret_cast<unsigned char *>(&this->bytes[0]));
+}
+
+std::string SHA1Hash::hex() const {
+    return toHex(bytes, hashSize);
+}
+
+static const EVP_MD *digestFor(int hashType) {
+    switch (hashType) {
+        case CS_HASHTYPE_SHA1:
+            return EVP_sha1();
+        case CS_HASHTYPE_SHA256:
+            return EVP_sha256();
+        default:
+            throw std::runtime_error{"unsupported hash type: " + std::to_string(hashType)};
+    }
+}
+
+template<typename H>
+Hasher<H>::Hasher() {
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (!ctx || EVP_DigestInit_ex(ctx, digestFor(H::hashType), nullptr) != 1) {
+        EVP_MD_CTX_free(ctx);
+        throw std::runtime_error{"initialising digest"};
+    }
+    context = ctx;
+}
+
+template<typename H>
+Hasher<H>::~Hasher() {
+    EVP_MD_CTX_free(static_cast<EVP_MD_CTX *>(context));
+}
+
+template<typename H>
+void Hasher<H>::update(const char *data, size_t len) {
+    EVP_DigestUpdate(static_cast<EVP_MD_CTX *>(context), data, len);
+}
+
+template<typename H>
+H Hasher<H>::finish() {
+    H hash{};
+    EVP_DigestFinal_ex(static_cast<EVP_MD_CTX *>(context), reinterpret_cast<unsigned char *>(hash.bytes), nullptr);
+    return hash;
+}
+
+template class Hasher<SHA1Hash>;
+template class Hasher<SHA256Hash>;
 };
@@ -2,10 +2,14 @@
 #define SIGTOOL_HASH_H
 
 #include <cstddef>
+#include <cstring>
 #include <string>
 #include "magic_numbers.h"
 
 namespace SigTool {
+// Lower case hex digits of the bytes
+std::string toHex(const char *bytes, size_t len);
+
 struct SHA256Hash {
     static const int constexpr hashSize = 32;
     static const int constexpr hashType = CS_HASHTYPE_SHA256;
@@ -17,6 +21,47 @@ struct SHA256Hash {
     explicit SHA256Hash(const std::string &str);
 
     SHA256Hash(): bytes{} {};
+
+    bool operator==(const SHA256Hash &other) const {
+        return memcmp(bytes, other.bytes, hashSize) == 0;
+    }
+
+    bool operator!=(const SHA256Hash &other) const {
+        return !(*this == other);
+    }
+
+    std::string hex() const;
+};
+
+// Only used for sealing resources, code is always hashed with SHA256
+struct SHA1Hash {
+    static const int constexpr hashSize = 20;
+    static const int constexpr hashType = CS_HASHTYPE_SHA1;
+    char bytes[hashSize]{};
+
+    SHA1Hash(const char *data, size_t len);
+
+    SHA1Hash(): bytes{} {};
+
+    std::string hex() const;
+};
+
+// Incremental digest, for input which is not held in memory at once.
+// Instantiated for SHA1Hash and SHA256Hash.
+template<typename H>
+class Hasher {
+public:
+    Hasher();
+    ~Hasher();
+
+    Hasher(const Hasher &) = delete;
+    Hasher &operator=(const Hasher &) = delete;
+
+    void update(const char *data, size_t len);
+    H finish();
+
+private:
+    void *context;
 };
 
 using Hash = SHA256Hash;
@@ -0,0 +1,354 @@
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "commands.h"
+#include "macho.h"
+#include "signature.h"
+
+namespace SigTool {
+
+// Receives the decoded signature as nested keyed values, so a single
+// decoder drives both output formats. Output is written as it is
+// produced; nothing is accumulated.
+class InspectWriter {
+public:
+    virtual ~InspectWriter() = default;
+
+    // key is ignored for elements of an array
+    virtual void beginObject(const std::string &key) = 0;
+    virtual void endObject() = 0;
+    virtual void beginArray(const std::string &key) = 0;
+    virtual void endArray() = 0;
+    virtual void number(const std::string &key, uint64_t value, bool hex = false) = 0;
+    virtual void string(const std::string &key, const std::string &value) = 0;
+    virtual void null(const std::string &key) = 0;
+};
+
+class TextWriter : public InspectWriter {
+public:
+    explicit TextWriter(std::ostream &os) : os(os) {}
+
+    void beginObject(const std::string &key) override {
+        line(key);
+        os << std::endl;
+        enter(false);
+    }
+
+    void endObject() override {
+        leave();
+    }
+
+    void beginArray(const std::string &key) override {
+        line(key);
+        os << std::endl;
+        enter(true);
+    }
+
+    void endArray() override {
+        leave();
+    }
+
+    void number(const std::string &key, uint64_t value, bool hex) override {
+        line(key);
+        if (hex) {
+            os << " 0x" << std::hex << value << std::dec << std::endl;
+        } else {
+            os << " " << value << std::endl;
+        }
+    }
+
+    void string(const std::string &key, const std::string &value) override {
+        line(key);
+        os << " " << value << std::endl;
+    }
+
+    void null(const std::string &key) override {
+        line(key);
+        os << " none" << std::endl;
+    }
+
+private:
+    std::ostream &os;
+    // For each level, whether it is an array and the next element index
+    std::vector<std::pair<bool, unsigned int>> levels;
+
+    void enter(bool array) {
+        levels.emplace_back(array, 0);
+    }
+
+    void leave() {
+        levels.pop_back();
+    }
+
+    void line(const std::string &key) {
+        os << std::string(2 * levels.size(), ' ');
+        if (!levels.empty() && levels.back().first) {
+            os << "[" << levels.back().second++ << "]";
+        } else {
+            os << key << ":";
+        }
+    }
+};
+
+class JSONWriter : public InspectWriter {
+public:
+    explicit JSONWriter(std::ostream &os) : os(os) {}
+
+    void beginObject(const std::string &key) override {
+        prefix(key);
+        os << "{";
+        levels.emplace_back(false, true);
+    }
+
+    void endObject() override {
+        levels.pop_back();
+        os << "}";
+        if (levels.empty()) {
+            os << std::endl;
+        }
+    }
+
+    void beginArray(const std::string &key) override {
+        prefix(key);
+        os << "[";
+        levels.emplace_back(true, true);
+    }
+
+    void endArray() override {
+        levels.pop_back();
+        os << "]";
+    }
+
+    void number(const std::string &key, uint64_t value, bool) override {
+        prefix(key);
+        os << value;
+    }
+
+    void string(const std::string &key, const std::string &value) override {
+        prefix(key);
+        os << quote(value);
+    }
+
+    void null(const std::string &key) override {
+        prefix(key);
+        os << "null";
+    }
+
+private:
+    std::ostream &os;
+    // For each level, whether it is an array and whether it is still empty
+    std::vector<std::pair<bool, bool>> levels;
+
+    void prefix(const std::string &key) {
+        if (levels.empty()) {
+            return;
+        }
+        if (!levels.back().second) {
+            os << ",";
+        }
+        levels.back().second = false;
+        if (!levels.back().first) {
+            os << quote(key) << ":";
+        }
+    }
+
+    static std::string quote(const std::string &value) {
+        std::ostringstream out;
+        out << '"';
+        for (unsigned char c : value) {
+            switch (c) {
+                case '"': out << "\\\""; break;
+                case '\\': out << "\\\\"; break;
+                case '\n': out << "\\n"; break;
+                case '\t': out << "\\t"; break;
+                default:
+                    if (c < 0x20) {
+                        out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int) c
+                            << std::dec << std::setfill(' ');
+                    } else {
+                        out << c;
+                    }
+            }
+        }
+        out << '"';
+        return out.str();
+    }
+};
+
+static std::string archName(const MachO &macho) {
+    try {
+        return cpuTypeName(macho.header.cpuType, macho.header.cpuSubType);
+    } catch (std::runtime_error &e) {
+        return "cpu" + std::to_string(macho.header.cpuType) + "/" + std::to_string(macho.header.cpuSubType);
+    }
+}
+
+static std::string slotName(uint32_t slot) {
+    switch (slot) {
+        case CSSLOT_CODEDIRECTORY: return "CodeDirectory";
+        case CSSLOT_INFOSLOT: return "InfoSlot";
+        case CSSLOT_REQUIREMENTS: return "Requirements";
+        case CSSLOT_RESOURCEDIR: return "ResourceDir";
+        case CSSLOT_ENTITLEMENTS: return "Entitlements";
+        case CSSLOT_DER_ENTITLEMENTS: return "DEREntitlements";
+        case CSSLOT_SIGNATURESLOT: return "Signature";
+        default:
+            if (slot >= CSSLOT_ALTERNATE_CODEDIRECTORIES && slot < CSSLOT_ALTERNATE_CODEDIRECTORIES + 5) {
+                return "AlternateCodeDirectory";
+            }
+            return "Unknown";
+    }
+}
+
+static uint32_t readBE32(const std::string &bytes, size_t offset) {
+    std::istringstream is{bytes.substr(offset, sizeof(uint32_t))};
+    return ReadBE::readUInt32(is);
+}
+
+static void inspectCodeDirectory(InspectWriter &out, const std::string &blob) {
+    auto data = CodeDirectory::parseHeader(blob);
+
+    out.beginObject("codeDirectory");
+    out.number("version", data.version, true);
+    out.number("flags", data.flags, true);
+    out.number("hashOffset", data.hashOffset);
+    out.number("identOffset", data.identOffset);
+    out.number("nSpecialSlots", data.nSpecialSlots);
+    out.number("nCodeSlots", data.nCodeSlots);
+    out.number("codeLimit", data.codeLimit);
+    out.number("hashSize", data.hashSize);
+    out.number("hashType", data.hashType);
+    out.number("platform", data.platform);
+    out.number("pageSize", data.pageSize ? 1u << data.pageSize : 0, true);
+    out.number("scatterOffset", data.scatterOffset);
+    out.number("teamOffset", data.teamOffset);
+    out.number("codeLimit64", data.codeLimit64);
+    out.number("execSegBase", data.execSegBase);
+    out.number("execSegLimit", data.execSegLimit);
+    out.number("execSegFlags", data.execSegFlags, true);
+
+    auto identEnd = blob.find('\0', data.identOffset);
+    if (data.identOffset < blob.size() && identEnd != std::string::npos) {
+        out.string("identifier", blob.substr(data.identOffset, identEnd - data.identOffset));
+    }
+
+    uint64_t hashesEnd = data.hashOffset + (uint64_t) data.nCodeSlots * data.hashSize;
+    if (data.hashOffset < (uint64_t) data.nSpecialSlots * data.hashSize || hashesEnd > blob.size()) {
+        out.string("error", "hashes extend beyond the code directory");
+        out.endObject();
+        return;
+    }
+
+    out.beginArray("specialHashes");
+    for (unsigned int slot = 1; slot <= data.nSpecialSlots; slot++) {
+        out.beginObject("");
+        out.number("slot", slot);
+        out.string("hash", toHex(&blob[data.hashOffset - slot * data.hashSize], data.hashSize));
+        out.endObject();
+    }
+    out.endArray();
+
+    out.beginArray("codeHashes");
+    for (uint64_t offset = data.hashOffset; offset < hashesEnd; offset += data.hashSize) {
+        out.string("", toHex(&blob[offset], data.hashSize));
+    }
+    out.endArray();
+
+    out.endObject();
+}
+
+static void inspectSignature(InspectWriter &out, const std::string &signature) {
+    out.beginObject("signature");
+    out.number("magic", readBE32(signature, 0), true);
+    out.number("length", readBE32(signature, sizeof(uint32_t)));
+
+    out.beginArray("blobs");
+    for (const auto &entry : SuperBlob::parseIndex(signature)) {
+        uint32_t magic = readBE32(signature, entry.offset);
+        uint32_t length = readBE32(signature, entry.offset + sizeof(uint32_t));
+        if ((uint64_t) entry.offset + length > signature.size() || length < 2 * sizeof(uint32_t)) {
+            throw std::runtime_error{"blob extends beyond the signature"};
+        }
+        std::string blob = signature.substr(entry.offset, length);
+
+        out.beginObject("");
+        out.number("slot", entry.type, true);
+        out.string("type", slotName(entry.type));
+        out.number("offset", entry.offset);
+        out.number("magic", magic, true);
+        out.number("length", length);
+
+        switch (magic) {
+            case CSMAGIC_CODEDIRECTORY:
+                inspectCodeDirectory(out, blob);
+                break;
+            case CSMAGIC_REQUIREMENTS:
+                out.number("count", length >= 3 * sizeof(uint32_t) ? readBE32(blob, 2 * sizeof(uint32_t)) : 0);
+                out.string("data", toHex(blob.data() + 2 * sizeof(uint32_t), blob.size() - 2 * sizeof(uint32_t)));
+                break;
+            case CSMAGIC_EMBEDDED_ENTITLEMENTS:
+                out.string("entitlements", blob.substr(2 * sizeof(uint32_t)));
+                break;
+            default:
+                out.string("data", toHex(blob.data() + 2 * sizeof(uint32_t), blob.size() - 2 * sizeof(uint32_t)));
+        }
+
+        out.endObject();
+    }
+    out.endArray();
+
+    out.endObject();
+}
+
+int Commands::inspect(const std::string &file, bool json) {
+    MachOList list{file};
+
+    std::ifstream f;
+    f.open(file, std::ifstream::in | std::ifstream::binary);
+    if (f.fail()) {
+        throw std::runtime_error(std::string{"opening input file: "} + strerror(errno));
+    }
+
+    TextWriter text{std::cout};
+    JSONWriter jsonWriter{std::cout};
+    InspectWriter &out = json ? static_cast<InspectWriter &>(jsonWriter) : text;
+
+    if (json) {
+        out.beginObject("");
+        out.string("file", file);
+        out.beginArray("slices");
+    }
+
+    for (const auto &macho : list.machos) {
+        out.beginObject(archName(*macho));
+        out.string("arch", archName(*macho));
+        out.number("cpuType", macho->header.cpuType, true);
+        out.number("cpuSubType", macho->header.cpuSubType, true);
+        out.number("offset", macho->offset);
+        out.number("size", macho->size);
+
+        auto codeSignature = macho->getCodeSignatureLoadCommand();
+        if (!codeSignature) {
+            out.null("signature");
+        } else {
+            out.number("dataOff", codeSignature->data.dataOff);
+            out.number("dataSize", codeSignature->data.dataSize);
+            inspectSignature(out, macho->readCodeSignatureData(f));
+        }
+
+        out.endObject();
+    }
+
+    if (json) {
+        out.endArray();
+        out.endObject();
+    }
+
+    return 0;
+}
+};
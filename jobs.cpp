@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <cassert>
+#include <sys/stat.h>
+#include <thread>
+
+#include "jobs.h"
+
+namespace SigTool {
+
+static unsigned int concurrencyOf(const JobQueue::Limits &limits) {
+    if (limits.concurrency == 0) {
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+    return limits.concurrency;
+}
+
+JobQueue::JobQueue(Limits limits) : limits(limits), pool(concurrencyOf(limits)) {}
+
+JobQueue::~JobQueue() {
+    std::unique_lock<std::mutex> lock{mutex};
+    idle.wait(lock, [this] { return queued.empty() && running == 0; });
+}
+
+JobQueue &JobQueue::shared() {
+    static JobQueue queue{Limits{0, 0}};
+    return queue;
+}
+
+void JobQueue::setLimits(Limits newLimits) {
+    std::unique_lock<std::mutex> lock{mutex};
+    limits = newLimits;
+    dispatch(lock);
+}
+
+std::shared_ptr<Job> JobQueue::sign(const Commands::CodesignOptions &options, const std::string &file,
+                                    Callback callback) {
+    return submit(file, [options, file](const std::atomic<bool> &cancelled) {
+        Commands::CodesignOptions jobOptions = options;
+        jobOptions.cancel = &cancelled;
+        JobResult result{};
+        result.status = Commands::codesign(jobOptions, file) == 0 ? JobResult::Status::Done
+                                                                  : JobResult::Status::Failed;
+        return result;
+    }, std::move(callback));
+}
+
+std::shared_ptr<Job> JobQueue::size(const Commands::SignOptions &options, Callback callback) {
+    return submit(options.filename, [options](const std::atomic<bool> &cancelled) {
+        Commands::SignOptions jobOptions = options;
+        jobOptions.cancel = &cancelled;
+        JobResult result{};
+        result.sizes = Commands::signatureSizes(jobOptions);
+        return result;
+    }, std::move(callback));
+}
+
+std::shared_ptr<Job> JobQueue::verify(const Commands::SignOptions &options, Callback callback) {
+    return submit(options.filename, [options](const std::atomic<bool> &cancelled) {
+        Commands::SignOptions jobOptions = options;
+        jobOptions.cancel = &cancelled;
+        JobResult result{};
+        result.valid = Commands::verify(jobOptions) == 0;
+        return result;
+    }, std::move(callback));
+}
+
+std::shared_ptr<Job> JobQueue::submit(const std::string &file,
+                                      std::function<JobResult(const std::atomic<bool> &)> work,
+                                      Callback callback) {
+    auto job = std::make_shared<Job>();
+    job->work = std::move(work);
+    job->callback = std::move(callback);
+
+    // Count the whole file against the limit; a missing file fails when run
+    struct stat st{};
+    if (stat(file.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+        job->bytes = st.st_size;
+    }
+
+    std::unique_lock<std::mutex> lock{mutex};
+    queued.push_back(job);
+    dispatch(lock);
+    return job;
+}
+
+void JobQueue::dispatch(std::unique_lock<std::mutex> &lock) {
+    assert(lock.owns_lock());
+    while (!queued.empty()) {
+        auto job = queued.front();
+
+        // Cancelled jobs leave the queue without waiting for a slot
+        bool start = job->cancelled;
+        if (!start && running < concurrencyOf(limits)) {
+            start = running == 0 || limits.bytesInFlight == 0 ||
+                    bytesRunning + job->bytes <= limits.bytesInFlight;
+        }
+        if (!start) {
+            return;
+        }
+
+        queued.pop_front();
+        running++;
+        bytesRunning += job->bytes;
+        pool.submit([this, job] { run(job); });
+    }
+}
+
+void JobQueue::run(const std::shared_ptr<Job> &job) {
+    JobResult result{};
+    if (job->cancelled) {
+        result.status = JobResult::Status::Cancelled;
+    } else {
+        try {
+            result = job->work(job->cancelled);
+        } catch (Commands::Cancelled &e) {
+            result = JobResult{};
+            result.status = JobResult::Status::Cancelled;
+        } catch (std::exception &e) {
+            result = JobResult{};
+            result.status = JobResult::Status::Failed;
+            result.error = e.what();
+        }
+    }
+
+    job->promise.set_value(result);
+    if (job->callback) {
+        job->callback(result);
+    }
+
+    std::unique_lock<std::mutex> lock{mutex};
+    running--;
+    bytesRunning -= job->bytes;
+    dispatch(lock);
+    if (queued.empty() && running == 0) {
+        idle.notify_all();
+    }
+}
+};
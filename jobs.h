@@ -0,0 +1,118 @@
+#ifndef SIGTOOL_JOBS_H
+#define SIGTOOL_JOBS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "commands.h"
+#include "workers.h"
+
+namespace SigTool {
+
+struct JobResult {
+    enum class Status {
+        Done,
+        Failed,
+        Cancelled,
+    };
+
+    Status status;
+    // The exception message of a failed job
+    std::string error;
+    // Size jobs: signature length per slice
+    std::vector<size_t> sizes;
+    // Verify jobs: whether the existing signature matches the file
+    bool valid;
+};
+
+// A submitted job. Its result is available as a future, and is also passed
+// to the completion callback, if any, on the worker thread which ran it.
+// Callbacks must not throw.
+class Job {
+public:
+    // Queued jobs finish without running once they reach the front of the
+    // queue; running jobs stop at the next batch of pages. Either way the
+    // result is Cancelled, unless the job completed first.
+    void cancel() {
+        cancelled = true;
+    }
+
+    std::shared_future<JobResult> result() const {
+        return future;
+    }
+
+private:
+    friend class JobQueue;
+
+    std::function<JobResult(const std::atomic<bool> &cancelled)> work;
+    std::function<void(const JobResult &)> callback;
+    uint64_t bytes = 0;
+
+    std::atomic<bool> cancelled{false};
+    std::promise<JobResult> promise;
+    std::shared_future<JobResult> future = promise.get_future().share();
+};
+
+// Runs signing jobs on a worker pool, starting them in submission order while
+// within a limit on concurrent jobs and on the total size of the files they
+// are working on. A job larger than the byte limit runs when it is alone.
+class JobQueue {
+public:
+    struct Limits {
+        // Jobs running at once, 0 for one per hardware thread
+        unsigned int concurrency;
+        // Total size of the files of running jobs, 0 for no limit
+        uint64_t bytesInFlight;
+    };
+
+    using Callback = std::function<void(const JobResult &)>;
+
+    explicit JobQueue(Limits limits);
+
+    // Waits for queued and running jobs
+    ~JobQueue();
+
+    JobQueue(const JobQueue &) = delete;
+    JobQueue &operator=(const JobQueue &) = delete;
+
+    // The queue shared by every caller in the process, without limits beyond
+    // one job per hardware thread until set otherwise
+    static JobQueue &shared();
+
+    // Raising concurrency beyond the size of the worker pool has no effect
+    void setLimits(Limits limits);
+
+    std::shared_ptr<Job> sign(const Commands::CodesignOptions &options, const std::string &file,
+                              Callback callback = Callback{});
+    std::shared_ptr<Job> size(const Commands::SignOptions &options, Callback callback = Callback{});
+    std::shared_ptr<Job> verify(const Commands::SignOptions &options, Callback callback = Callback{});
+
+private:
+    std::shared_ptr<Job> submit(const std::string &file,
+                                std::function<JobResult(const std::atomic<bool> &)> work,
+                                Callback callback);
+    // Start queued jobs while there is room; lock must hold mutex
+    void dispatch(std::unique_lock<std::mutex> &lock);
+    void run(const std::shared_ptr<Job> &job);
+
+    std::mutex mutex;
+    std::condition_variable idle;
+    Limits limits;
+    std::deque<std::shared_ptr<Job>> queued;
+    unsigned int running = 0;
+    uint64_t bytesRunning = 0;
+
+    // Last, so that it is joined before the state above is destroyed
+    WorkerPool pool;
+};
+};
+
+#endif // SIGTOOL_JOBS_H
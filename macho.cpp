@@ -1,39 +1,61 @@
 #include <cstring>
 #include <sys/stat.h>
 #include "macho.h"
+#include "probes.h"
 
 namespace SigTool {
 
-constexpr const uint32_t MH_MAGIC_64 = 0xFEEDFACF;
-constexpr const uint32_t MH_CIGAM_64 = 0xCFFAEDFE;
-
-constexpr const uint32_t MH_FAT_MAGIC = 0xCAFEBABE;
-constexpr const uint32_t MH_FAT_CIGAM = 0xBEBAFECA;
-
 MachOList::MachOList(const std::string &filename) {
     std::ifstream f;
     f.open(filename, std::ifstream::in | std::ifstream::binary);
     if (f.fail()) {
         throw std::runtime_error(std::string{"opening input file: "} + strerror(errno));
     }
+    SIGTOOL_PROBE1(file__open, filename.c_str());
+
+    struct stat targetFileStat{};
+    if (stat(filename.c_str(), &targetFileStat) != 0) {
+        throw std::runtime_error{std::string{"Stat of "} + filename + " failed: " + strerror(errno)};
+    }
+
+    parse(f, targetFileStat.st_size);
+}
+
+MachOList::MachOList(std::istream &f, size_t size) {
+    parse(f, size);
+}
+
+void MachOList::parse(std::istream &f, size_t size) {
+    SIGTOOL_PROBE1(parse__start, size);
 
     auto magic = Read::readBytes<uint32_t>(f);
 
-    if (magic != MH_MAGIC_64 && magic != MH_CIGAM_64 && magic != MH_FAT_MAGIC && magic != MH_FAT_CIGAM) {
+    if (!isMachOMagic(magic)) {
         throw NotAMachOFileException{magic};
     }
 
-    if (magic == MH_FAT_CIGAM) {
+    if (magic == MH_FAT_CIGAM || magic == MH_FAT_CIGAM_64) {
         // Many files in one file
+        bool fat64 = magic == MH_FAT_CIGAM_64;
         auto count = ReadBE::readUInt32(f);
-        for (int i = 0; i < count; i++) {
+        for (uint32_t i = 0; i < count; i++) {
             FatHeader fatHeader{};
 
             fatHeader.cpuType = ReadBE::readUInt32(f);
             fatHeader.cpuSubType = ReadBE::readUInt32(f);
-            fatHeader.offset = ReadBE::readUInt32(f);
-            fatHeader.size = ReadBE::readUInt32(f);
-            fatHeader.align = ReadBE::readUInt32(f);
+            if (fat64) {
+                fatHeader.offset = ReadBE::readUInt64(f);
+                fatHeader.size = ReadBE::readUInt64(f);
+                fatHeader.align = ReadBE::readUInt32(f);
+                ReadBE::readUInt32(f); // reserved
+            } else {
+                fatHeader.offset = ReadBE::readUInt32(f);
+                fatHeader.size = ReadBE::readUInt32(f);
+                fatHeader.align = ReadBE::readUInt32(f);
+            }
+            if (f.fail()) {
+                throw std::runtime_error{"truncated fat header"};
+            }
 
             auto preserve = f.tellg();
             f.seekg(fatHeader.offset);
@@ -43,20 +65,21 @@ MachOList::MachOList(const std::string &filename) {
     } else if (magic == MH_MAGIC_64) {
         // Single file
         f.seekg(0);
-        struct stat targetFileStat{};
-        if (stat(filename.c_str(), &targetFileStat) != 0) {
-            throw std::runtime_error{std::string{"Stat of "} + filename + " failed: " + strerror(errno)};
-        }
-
-        machos.push_back(std::make_shared<MachO>(f, 0, targetFileStat.st_size));
+        machos.push_back(std::make_shared<MachO>(f, 0, size));
     } else {
         throw std::runtime_error{
                 std::string{"Unexpected magic parsing macho file: "} + std::to_string(magic)};
     }
 
+    SIGTOOL_PROBE2(parse__end, size, machos.size());
 }
 
-MachO::MachO(std::ifstream &f, off_t offset, size_t size) : header{}, offset{offset}, size{size} {
+bool isMachOMagic(uint32_t magic) {
+    return magic == MH_MAGIC_64 || magic == MH_CIGAM_64 || magic == MH_FAT_MAGIC || magic == MH_FAT_CIGAM ||
+           magic == MH_FAT_MAGIC_64 || magic == MH_FAT_CIGAM_64;
+}
+
+MachO::MachO(std::istream &f, off_t offset, size_t size) : header{}, offset{offset}, size{size} {
     auto magic = Read::readBytes<uint32_t>(f);
 
     if (magic != MH_MAGIC_64 && magic != MH_CIGAM_64) {
@@ -64,6 +87,7 @@ MachO::MachO(std::ifstream &f, off_t offset, size_t size) : header{}, offset{off
     }
 
     f.read(reinterpret_cast<char *>(&header), sizeof(header));
+    uint64_t commandsEnd = sizeof(magic) + sizeof(header) + header.sizeOfCmds;
 
     for (int cmdIdx = 0; cmdIdx < header.nCommands; cmdIdx++) {
         off_t start = f.tellg();
@@ -76,6 +100,15 @@ MachO::MachO(std::ifstream &f, off_t offset, size_t size) : header{}, offset{off
                 auto lcSegment = std::make_shared<Segment64LoadCommand>(type, cmdSize);
                 f.read(reinterpret_cast<char *>(&lcSegment->data),
                        sizeof(Segment64LoadCommand::data));
+
+                uint64_t commandStart = start - offset;
+                uint64_t sectionsEnd = commandStart + 2 * sizeof(uint32_t) + sizeof(Segment64LoadCommand::data)
+                                       + (uint64_t) lcSegment->data.nsects * sizeof(Section64);
+                if (sectionsEnd <= commandStart + cmdSize && sectionsEnd <= commandsEnd) {
+                    lcSegment->sections.resize(lcSegment->data.nsects);
+                    f.read(reinterpret_cast<char *>(lcSegment->sections.data()),
+                           lcSegment->sections.size() * sizeof(Section64));
+                }
                 loadCommands.push_back(lcSegment);
                 break;
             }
@@ -93,6 +126,11 @@ MachO::MachO(std::ifstream &f, off_t offset, size_t size) : header{}, offset{off
                 loadCommands.push_back(lc);
         }
 
+        if (f.fail()) {
+            throw std::runtime_error{"truncated load commands"};
+        }
+        loadCommands.back()->offset = start - offset;
+
         size_t actualRead = f.tellg() - start;
 
         // Laziness: allow partial reads by skpping ahead
@@ -120,6 +158,16 @@ std::shared_ptr<Segment64LoadCommand> MachO::getSegment64LoadCommand(const std::
     return std::shared_ptr<Segment64LoadCommand>{};
 }
 
+std::vector<std::shared_ptr<Segment64LoadCommand>> MachO::getSegment64LoadCommands() {
+    std::vector<std::shared_ptr<Segment64LoadCommand>> segments;
+    for (const auto &lc : loadCommands) {
+        if (lc->type == LC_SEGMENT_64) {
+            segments.push_back(std::static_pointer_cast<Segment64LoadCommand>(lc));
+        }
+    }
+    return segments;
+}
+
 std::shared_ptr<CodeSignatureLoadCommand> MachO::getCodeSignatureLoadCommand() {
     for (const auto &lc : loadCommands) {
         if (lc->type != LC_CODE_SIGNATURE) {
@@ -131,6 +179,24 @@ std::shared_ptr<CodeSignatureLoadCommand> MachO::getCodeSignatureLoadCommand() {
     return std::shared_ptr<CodeSignatureLoadCommand>{};
 }
 
+std::string MachO::readCodeSignatureData(std::istream &f) {
+    auto codeSignature = getCodeSignatureLoadCommand();
+    if (!codeSignature) {
+        return std::string{};
+    }
+
+    std::string bytes;
+    bytes.resize(codeSignature->data.dataSize);
+
+    f.seekg(offset + codeSignature->data.dataOff);
+    f.read(&bytes[0], bytes.size());
+    if (f.fail()) {
+        throw std::runtime_error{std::string{"reading code signature: "} + strerror(errno)};
+    }
+
+    return bytes;
+}
+
 bool MachO::requiresSignature() {
     return (
             header.filetype == MH_EXECUTE || header.filetype == MH_DYLIB ||
@@ -139,4 +205,19 @@ bool MachO::requiresSignature() {
     );
 }
 
+std::string cpuTypeName(uint32_t cpuType, uint32_t cpuSubType) {
+    switch (cpuType | cpuSubType) {
+        case CPUTYPE_X86_64:
+            return "x86_64";
+        case CPUTYPE_X86_64H:
+            return "x86_64h";
+        case CPUTYPE_ARM64:
+            return "arm64";
+        case CPUTYPE_ARM64E:
+            return "arm64e";
+        default:
+            throw std::runtime_error{std::string{"Unsupported cpu type"} + std::to_string(cpuType)};
+    }
+}
+
 };
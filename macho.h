@@ -25,6 +25,16 @@
 
 namespace SigTool {
 
+constexpr const uint32_t MH_MAGIC_64 = 0xFEEDFACF;
+constexpr const uint32_t MH_CIGAM_64 = 0xCFFAEDFE;
+
+constexpr const uint32_t MH_FAT_MAGIC = 0xCAFEBABE;
+constexpr const uint32_t MH_FAT_CIGAM = 0xBEBAFECA;
+
+// Universal files whose slice offsets and sizes are 64-bit
+constexpr const uint32_t MH_FAT_MAGIC_64 = 0xCAFEBABF;
+constexpr const uint32_t MH_FAT_CIGAM_64 = 0xBFBAFECA;
+
 enum {
     MH_EXECUTE = 0x2,
     MH_PRELOAD = 0x5,
@@ -56,6 +66,14 @@ enum LCType {
     LC_SEGMENT_64 = 0x19,
 };
 
+// Section types, the low byte of a section's flags
+enum {
+    SECTION_TYPE = 0xff,
+    S_ZEROFILL = 0x1,
+    S_GB_ZEROFILL = 0xc,
+    S_THREAD_LOCAL_ZEROFILL = 0x12,
+};
+
 struct MachOHeader {
     uint32_t cpuType;
     uint32_t cpuSubType;
@@ -66,21 +84,40 @@ struct MachOHeader {
     uint32_t reserved; // only for 64-bit
 } __attribute__((packed));
 
+// fat_arch or fat_arch_64, widened
 struct FatHeader {
     uint32_t cpuType;
     uint32_t cpuSubType;
-    uint32_t offset;
-    uint32_t size;
+    uint64_t offset;
+    uint64_t size;
     uint32_t align;
 };
 
 struct LoadCommand {
     uint32_t type;
     uint32_t cmdSize;
+    // Where the command starts, relative to the start of the slice
+    uint64_t offset = 0;
 
     explicit LoadCommand(uint32_t type, uint32_t cmdSize) : type(type), cmdSize(cmdSize) {};
 };
 
+// section_64
+struct Section64 {
+    char sectname[16];
+    char segname[16];
+    uint64_t addr;
+    uint64_t size;
+    uint32_t offset;
+    uint32_t align;
+    uint32_t reloff;
+    uint32_t nreloc;
+    uint32_t flags;
+    uint32_t reserved1;
+    uint32_t reserved2;
+    uint32_t reserved3;
+} __attribute__((packed));
+
 struct Segment64LoadCommand : public LoadCommand {
     explicit Segment64LoadCommand(uint32_t type, uint32_t cmdSize)
             : LoadCommand(type, cmdSize) {};
@@ -91,7 +128,14 @@ struct Segment64LoadCommand : public LoadCommand {
         uint64_t vmsize;
         uint64_t fileoff;
         uint64_t filesize;
+        uint32_t maxprot;
+        uint32_t initprot;
+        uint32_t nsects;
+        uint32_t flags;
     } __attribute__((packed)) data{};
+
+    // Empty if the command is too short to hold data.nsects of them
+    std::vector<Section64> sections;
 };
 
 struct CodeSignatureLoadCommand : public LoadCommand {
@@ -106,7 +150,7 @@ struct CodeSignatureLoadCommand : public LoadCommand {
 
 // A single architecture slice
 struct MachO {
-    explicit MachO(std::ifstream &f, off_t offset, size_t size);
+    explicit MachO(std::istream &f, off_t offset, size_t size);
 
     MachOHeader header;
     off_t offset;
@@ -114,8 +158,13 @@ struct MachO {
 
     std::shared_ptr<Segment64LoadCommand> getSegment64LoadCommand(const std::string &name);
 
+    std::vector<std::shared_ptr<Segment64LoadCommand>> getSegment64LoadCommands();
+
     std::shared_ptr<CodeSignatureLoadCommand> getCodeSignatureLoadCommand();
 
+    // The raw contents of the LC_CODE_SIGNATURE region, empty if there is none
+    std::string readCodeSignatureData(std::istream &f);
+
     bool requiresSignature();
 
 private:
@@ -126,9 +175,22 @@ private:
 struct MachOList {
     explicit MachOList(const std::string &f);
 
+    // Parse from a seekable stream holding the whole file, such as an
+    // in-memory copy of an archive entry
+    explicit MachOList(std::istream &f, size_t size);
+
     std::vector<std::shared_ptr<MachO>> machos;
+
+private:
+    void parse(std::istream &f, size_t size);
 };
 
+std::string cpuTypeName(uint32_t cpuType, uint32_t cpuSubType);
+
+// Whether a file starting with these four bytes, read in native byte
+// order, is one that MachOList accepts
+bool isMachOMagic(uint32_t magic);
+
 struct NotAMachOFileException : public std::exception {
     uint32_t magic;
 
@@ -12,6 +12,7 @@ enum {
     CSMAGIC_CODEDIRECTORY = 0xfade0c02,
     CSMAGIC_REQUIREMENTS = 0xfade0c01,
     CSMAGIC_EMBEDDED_ENTITLEMENTS = 0xfade7171,
+    CSMAGIC_EMBEDDED_DER_ENTITLEMENTS = 0xfade7172,
     CSMAGIC_BLOBWRAPPER = 0xfade0b01,
 };
 
@@ -20,13 +21,18 @@ enum {
 };
 
 enum {
+    CS_HASHTYPE_SHA1 = 1,
     CS_HASHTYPE_SHA256 = 2,
 };
 
 enum CSSlot {
     CSSLOT_CODEDIRECTORY = 0,
+    CSSLOT_INFOSLOT = 1,
     CSSLOT_REQUIREMENTS = 2,
+    CSSLOT_RESOURCEDIR = 3,
     CSSLOT_ENTITLEMENTS = 5,
+    CSSLOT_DER_ENTITLEMENTS = 7,
+    CSSLOT_ALTERNATE_CODEDIRECTORIES = 0x1000,
     CSSLOT_SIGNATURESLOT = 0x10000,
 };
 };
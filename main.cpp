@@ -1,46 +1,214 @@
 #include "commands.h"
+#include "governor.h"
 #include <CLI11.hpp>
+#include <fstream>
 
 int main(int argc, char **argv) {
     CLI::App app{"sigtool"};
     app.require_subcommand();
 
     std::string file, identifier, entitlements;
-    app.add_option("-f,--file", file, "Mach-O target file")
-            ->required();
+    app.add_option("-f,--file", file, "Mach-O target file");
     app.add_option("-i,--identifier", identifier, "File identifier");
     app.add_option("-e,--entitlements", entitlements, "Entitlements plist");
 
+    uint64_t ioRate = 0;
+    double cpuShare = 1.0;
+    bool psiBackoff = false;
+    app.add_option("--io-rate", ioRate, "Read and write budget in bytes per second, e.g. 50MB")
+            ->transform(CLI::AsSizeValue(false));
+    app.add_option("--cpu-share", cpuShare, "Fraction of time each signing thread may spend on the CPU")
+            ->check(CLI::Range(0.01, 1.0));
+    app.add_flag("--psi-backoff", psiBackoff, "Lower the IO budget while /proc/pressure/io reports contention");
+
     app.add_subcommand("check-requires-signature",
                        "Determine if this is a macho file that must be signed");
 
     app.add_subcommand("size", "Determine size of embedded signature");
-    app.add_subcommand("generate", "Generate an embedded signature and emit on stdout");
-    app.add_subcommand("inject", "Generate and inject embedded signature");
+    SigTool::Commands::GenerateOptions generateOptions{};
+    auto generate = app.add_subcommand("generate", "Generate an embedded signature and emit on stdout");
+    auto outputDir = generate->add_option("--output-dir", generateOptions.outputDir,
+                                          "Write a signature per architecture into this directory");
+    generate->add_flag("--indexed", generateOptions.indexed,
+                       "Emit an indexed container of per-architecture signatures")
+            ->excludes(outputDir);
+    bool injectCDHash = false;
+    auto inject = app.add_subcommand("inject", "Generate and inject embedded signature");
+    inject->add_flag("--cdhash", injectCDHash, "Print the cdhash of each slice's new signature");
     app.add_subcommand("show-arch", "Show architecture");
+    app.add_subcommand("verify", "Check the embedded signature of each slice against its contents");
+
+    std::string dirtyRanges;
+    auto resign = app.add_subcommand("resign", "Rehash only the pages in the given ranges and patch the signature");
+    resign->add_option("--dirty-ranges", dirtyRanges,
+                       "File of modified 'offset length' byte ranges, or - for stdin")
+            ->required();
+
+    std::string variantsFile;
+    bool variantsEmit = false;
+    auto variants = app.add_subcommand("variants", "Sign copies of the file under several identifiers and entitlements");
+    variants->add_option("--variants", variantsFile,
+                         "File of 'identifier entitlements output' lines, or - for stdin")
+            ->required();
+    variants->add_flag("--emit", variantsEmit, "Write each variant's signature rather than a signed copy");
+
+    std::string manifestFormat = "binary";
+    auto manifest = app.add_subcommand("manifest", "Emit the page hashes of each slice on stdout");
+    manifest->add_option("--format", manifestFormat, "Manifest format")
+            ->check(CLI::IsMember({"binary", "json"}));
+
+    std::vector<std::string> diffFiles;
+    auto diff = app.add_subcommand("diff", "List differing page ranges of two signed files or manifests");
+    diff->add_option("files", diffFiles, "Files to compare")
+            ->expected(2)
+            ->required();
+
+    std::string mergeOutput;
+    std::vector<std::string> mergeInputs;
+    auto merge = app.add_subcommand("merge", "Build a universal file from signed thin files, keeping their signatures");
+    merge->add_option("-o,--output", mergeOutput, "Universal file to write")
+            ->required();
+    merge->add_option("files", mergeInputs, "Signed thin files")
+            ->required();
+
+    bool inspectJSON = false;
+    auto inspect = app.add_subcommand("inspect", "Decode the embedded signature of each slice");
+    inspect->add_flag("--json", inspectJSON, "Emit JSON instead of text");
+
+    std::vector<std::string> cdhashFiles;
+    std::string cdhashOutput;
+    auto cdhash = app.add_subcommand("cdhash", "List the cdhashes of signed files, or write them as a sorted index");
+    cdhash->add_option("files", cdhashFiles, "Signed files")
+            ->required();
+    cdhash->add_option("-o,--output", cdhashOutput, "Binary index to write instead of text on stdout");
+
+    std::string lookupIndex;
+    std::vector<std::string> lookupHashes;
+    auto cdhashLookup = app.add_subcommand("cdhash-lookup", "Find the files with the given cdhashes in an index");
+    cdhashLookup->add_option("--index", lookupIndex, "Binary index written by cdhash -o")
+            ->required();
+    cdhashLookup->add_option("cdhashes", lookupHashes, "cdhashes in hex")
+            ->required();
+
+    std::string archiveFormat = "auto";
+    auto signArchive = app.add_subcommand("sign-archive",
+                                          "Sign the Mach-O files in a NAR or tar archive from stdin onto stdout");
+    signArchive->add_option("--format", archiveFormat, "Archive format", true)
+            ->check(CLI::IsMember({"auto", "nar", "tar"}));
+
+    SigTool::Commands::WatchOptions watchOptions{};
+    watchOptions.debounceMs = 50;
+    auto watch = app.add_subcommand("watch", "Re-sign Mach-O files under a directory whenever they are written");
+    watch->add_option("directory", watchOptions.directory, "Directory to watch")
+            ->required();
+    watch->add_option("-j,--jobs", watchOptions.jobs, "Worker threads, defaults to one per CPU");
+    watch->add_option("--debounce", watchOptions.debounceMs,
+                      "Milliseconds without writes before a file is signed", true);
 
     app.require_subcommand();
 
     CLI11_PARSE(app, argc, argv);
 
+    SigTool::Governor::shared().setLimits({ioRate, cpuShare, psiBackoff});
+
+    if (app.got_subcommand("watch")) {
+        watchOptions.identifier = identifier;
+        watchOptions.entitlements = entitlements;
+        return SigTool::Commands::watch(watchOptions);
+    }
+
+    if (app.got_subcommand("merge")) {
+        return SigTool::Commands::merge(mergeOutput, mergeInputs);
+    }
+
+    if (app.got_subcommand("cdhash")) {
+        return SigTool::Commands::cdhashIndex(cdhashFiles, cdhashOutput);
+    }
+
+    if (app.got_subcommand("cdhash-lookup")) {
+        return SigTool::Commands::cdhashLookup(lookupIndex, lookupHashes);
+    }
+
+    if (app.got_subcommand("diff")) {
+        return SigTool::Commands::diff(diffFiles[0], diffFiles[1]);
+    }
+
+    if (app.got_subcommand("sign-archive")) {
+        SigTool::Commands::SignOptions options{
+                .filename = "",
+                .identifier = identifier,
+                .entitlements = entitlements,
+                .infoPlist = "",
+                .resources = "",
+                .cancel = nullptr,
+        };
+        auto format = archiveFormat == "nar" ? SigTool::Commands::ArchiveFormat::NAR
+                    : archiveFormat == "tar" ? SigTool::Commands::ArchiveFormat::Tar
+                    : SigTool::Commands::ArchiveFormat::Auto;
+        return SigTool::Commands::signArchive(options, format);
+    }
+
+    if (file.empty()) {
+        std::cerr << "--file is required" << std::endl;
+        return 1;
+    }
+
     if (app.got_subcommand("check-requires-signature")) {
         return SigTool::Commands::checkRequiresSignature(file);
     } else if (app.got_subcommand("show-arch")) {
         return SigTool::Commands::showArch(file);
+    } else if (app.got_subcommand("inspect")) {
+        return SigTool::Commands::inspect(file, inspectJSON);
+    } else if (app.got_subcommand("manifest")) {
+        return SigTool::Commands::manifest(file, manifestFormat == "json");
     }
 
     SigTool::Commands::SignOptions options{
             .filename = file,
             .identifier = identifier,
             .entitlements = entitlements,
+            .infoPlist = "",
+            .resources = "",
+            .cancel = nullptr,
     };
 
     if (app.got_subcommand("size")) {
         return SigTool::Commands::showSize(options);
     } else if (app.got_subcommand("generate")) {
-        return SigTool::Commands::generate(options);
+        return SigTool::Commands::generate(options, generateOptions);
     } else if (app.got_subcommand("inject")) {
-        return SigTool::Commands::inject(options);
+        std::vector<SigTool::CDHashEntry> cdhashes;
+        int status = SigTool::Commands::inject(options, cdhashes);
+        if (injectCDHash) {
+            SigTool::CDHashIndex::emitText(std::cout, cdhashes);
+        }
+        return status;
+    } else if (app.got_subcommand("verify")) {
+        return SigTool::Commands::verify(options);
+    } else if (app.got_subcommand("resign")) {
+        std::vector<SigTool::Commands::ByteRange> ranges;
+        if (dirtyRanges == "-") {
+            ranges = SigTool::Commands::parseByteRanges(std::cin);
+        } else {
+            std::ifstream in{dirtyRanges};
+            if (!in.is_open()) {
+                throw std::runtime_error{"Failed opening dirty ranges: '" + dirtyRanges + "'"};
+            }
+            ranges = SigTool::Commands::parseByteRanges(in);
+        }
+        return SigTool::Commands::resign(options, ranges);
+    } else if (app.got_subcommand("variants")) {
+        std::vector<SigTool::Commands::SignVariant> list;
+        if (variantsFile == "-") {
+            list = SigTool::Commands::parseVariants(std::cin);
+        } else {
+            std::ifstream in{variantsFile};
+            if (!in.is_open()) {
+                throw std::runtime_error{"Failed opening variants: '" + variantsFile + "'"};
+            }
+            list = SigTool::Commands::parseVariants(in);
+        }
+        return SigTool::Commands::signVariants(options, list, variantsEmit);
     }
 
     return 0;
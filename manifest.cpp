@@ -0,0 +1,211 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#include "manifest.h"
+#include "macho.h"
+#include "signature.h"
+
+namespace SigTool {
+
+Manifest Manifest::fromMachO(const std::string &filename) {
+    MachOList list{filename};
+
+    std::ifstream f;
+    f.open(filename, std::ifstream::in | std::ifstream::binary);
+    if (f.fail()) {
+        throw std::runtime_error(std::string{"opening input file: "} + strerror(errno));
+    }
+
+    Manifest manifest{};
+    for (const auto &macho : list.machos) {
+        std::string signature = macho->readCodeSignatureData(f);
+        if (signature.empty()) {
+            throw std::runtime_error{filename + " has no embedded signature"};
+        }
+
+        auto codeDirectory = SuperBlob::parse(signature).codeDirectory();
+        if (!codeDirectory) {
+            throw std::runtime_error{filename + " has no code directory"};
+        }
+
+        SliceManifest slice{};
+        slice.cpuType = macho->header.cpuType;
+        slice.cpuSubType = macho->header.cpuSubType;
+        slice.offset = macho->offset;
+        slice.size = macho->size;
+        slice.codeLimit = codeDirectory->codeLimit();
+        slice.pageSize = 1u << codeDirectory->data.pageSize;
+        slice.codeHashes = std::move(codeDirectory->codeHashes);
+        manifest.slices.push_back(std::move(slice));
+    }
+
+    return manifest;
+}
+
+Manifest Manifest::parse(std::istream &is) {
+    if (ReadBE::readUInt32(is) != magic) {
+        throw std::runtime_error{"not a sigtool manifest"};
+    }
+    if (ReadBE::readUInt32(is) != version) {
+        throw std::runtime_error{"unsupported manifest version"};
+    }
+
+    Manifest manifest{};
+    uint32_t count = ReadBE::readUInt32(is);
+    for (uint32_t i = 0; i < count && is.good(); i++) {
+        SliceManifest slice{};
+        slice.cpuType = ReadBE::readUInt32(is);
+        slice.cpuSubType = ReadBE::readUInt32(is);
+        slice.offset = ReadBE::readUInt64(is);
+        slice.size = ReadBE::readUInt64(is);
+        slice.codeLimit = ReadBE::readUInt64(is);
+        slice.pageSize = ReadBE::readUInt32(is);
+        auto hashType = Read::readBytes<uint8_t>(is);
+        auto hashSize = Read::readBytes<uint8_t>(is);
+        Read::readBytes<uint16_t>(is); // reserved
+        uint32_t nHashes = ReadBE::readUInt32(is);
+
+        if (hashType != Hash::hashType || hashSize != Hash::hashSize) {
+            throw std::runtime_error{"unsupported manifest hash type: " + std::to_string(hashType)};
+        }
+
+        for (uint32_t page = 0; page < nHashes && is.good(); page++) {
+            Hash hash{};
+            is.read(hash.bytes, sizeof(hash.bytes));
+            slice.codeHashes.push_back(hash);
+        }
+
+        manifest.slices.push_back(std::move(slice));
+    }
+
+    if (is.fail()) {
+        throw std::runtime_error{"truncated manifest"};
+    }
+
+    return manifest;
+}
+
+Manifest Manifest::load(const std::string &filename) {
+    std::ifstream f;
+    f.open(filename, std::ifstream::in | std::ifstream::binary);
+    if (f.fail()) {
+        throw std::runtime_error(std::string{"opening input file: "} + strerror(errno));
+    }
+
+    if (ReadBE::readUInt32(f) == magic) {
+        f.seekg(0);
+        return parse(f);
+    }
+
+    f.close();
+    return fromMachO(filename);
+}
+
+void Manifest::emit(std::ostream &os) const {
+    EmitBE::writeUInt32(os, magic);
+    EmitBE::writeUInt32(os, version);
+    EmitBE::writeUInt32(os, slices.size());
+
+    for (const auto &slice : slices) {
+        EmitBE::writeUInt32(os, slice.cpuType);
+        EmitBE::writeUInt32(os, slice.cpuSubType);
+        EmitBE::writeUInt64(os, slice.offset);
+        EmitBE::writeUInt64(os, slice.size);
+        EmitBE::writeUInt64(os, slice.codeLimit);
+        EmitBE::writeUInt32(os, slice.pageSize);
+        EmitBE::writeBytes<uint8_t>(os, Hash::hashType);
+        EmitBE::writeBytes<uint8_t>(os, Hash::hashSize);
+        EmitBE::writeBytes<uint16_t>(os, 0);
+        EmitBE::writeUInt32(os, slice.codeHashes.size());
+        for (const auto &hash : slice.codeHashes) {
+            os.write(hash.bytes, sizeof(hash.bytes));
+        }
+    }
+}
+
+void Manifest::emitJSON(std::ostream &os) const {
+    os << "{\"version\":" << version << ",\"slices\":[";
+
+    for (size_t i = 0; i < slices.size(); i++) {
+        const auto &slice = slices[i];
+        os << (i ? "," : "") << "\n{"
+           << "\"arch\":\"" << cpuTypeName(slice.cpuType, slice.cpuSubType) << "\","
+           << "\"cpuType\":" << slice.cpuType << ","
+           << "\"cpuSubType\":" << slice.cpuSubType << ","
+           << "\"offset\":" << slice.offset << ","
+           << "\"size\":" << slice.size << ","
+           << "\"codeLimit\":" << slice.codeLimit << ","
+           << "\"pageSize\":" << slice.pageSize << ","
+           << "\"hashType\":\"sha256\","
+           << "\"hashes\":[";
+        for (size_t page = 0; page < slice.codeHashes.size(); page++) {
+            os << (page ? ",\n" : "\n") << "\"" << slice.codeHashes[page].hex() << "\"";
+        }
+        os << "]}";
+    }
+
+    os << "]}\n";
+}
+
+static bool sameArch(const SliceManifest &a, const SliceManifest &b) {
+    return a.cpuType == b.cpuType && (a.cpuSubType & ~CPU_SUBTYPE_MASK) == (b.cpuSubType & ~CPU_SUBTYPE_MASK);
+}
+
+ManifestDiff diffManifests(const Manifest &a, const Manifest &b) {
+    ManifestDiff diff{};
+
+    for (const auto &sliceA : a.slices) {
+        const SliceManifest *match = nullptr;
+        for (const auto &sliceB : b.slices) {
+            if (sameArch(sliceA, sliceB)) {
+                match = &sliceB;
+                break;
+            }
+        }
+
+        if (!match) {
+            diff.onlyInA.push_back(&sliceA);
+            continue;
+        }
+
+        if (sliceA.pageSize != match->pageSize) {
+            throw std::runtime_error{"cannot compare slices with different page sizes"};
+        }
+
+        size_t pages = std::max(sliceA.codeHashes.size(), match->codeHashes.size());
+        for (size_t page = 0; page < pages; page++) {
+            bool same = page < sliceA.codeHashes.size() && page < match->codeHashes.size() &&
+                        sliceA.codeHashes[page] == match->codeHashes[page];
+            if (same) {
+                continue;
+            }
+
+            // Extend the previous run if this page immediately follows it
+            if (!diff.changed.empty()) {
+                auto &last = diff.changed.back();
+                if (last.cpuType == sliceA.cpuType && last.cpuSubType == sliceA.cpuSubType &&
+                    last.firstPage + last.pageCount == page) {
+                    last.pageCount++;
+                    continue;
+                }
+            }
+
+            diff.changed.push_back(PageRange{sliceA.cpuType, sliceA.cpuSubType, sliceA.pageSize, page, 1});
+        }
+    }
+
+    for (const auto &sliceB : b.slices) {
+        bool matched = false;
+        for (const auto &sliceA : a.slices) {
+            matched = matched || sameArch(sliceA, sliceB);
+        }
+        if (!matched) {
+            diff.onlyInB.push_back(&sliceB);
+        }
+    }
+
+    return diff;
+}
+};
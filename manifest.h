@@ -0,0 +1,65 @@
+#ifndef SIGTOOL_MANIFEST_H
+#define SIGTOOL_MANIFEST_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "hash.h"
+
+namespace SigTool {
+
+// The page hashes of one slice, as recorded in its code directory
+struct SliceManifest {
+    uint32_t cpuType;
+    uint32_t cpuSubType;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t codeLimit;
+    uint32_t pageSize;
+    std::vector<Hash> codeHashes;
+};
+
+// A page-level fingerprint of every slice of a file. Built from the
+// embedded signatures, so page contents are never read.
+struct Manifest {
+    constexpr static const uint32_t magic = 0x7369676d; // 'sigm'
+    constexpr static const uint32_t version = 1;
+
+    std::vector<SliceManifest> slices;
+
+    static Manifest fromMachO(const std::string &filename);
+    static Manifest parse(std::istream &is);
+
+    // Either a binary manifest or a signed Mach-O file
+    static Manifest load(const std::string &filename);
+
+    void emit(std::ostream &os) const;
+    void emitJSON(std::ostream &os) const;
+};
+
+// A run of differing pages within a slice
+struct PageRange {
+    uint32_t cpuType;
+    uint32_t cpuSubType;
+    uint32_t pageSize;
+    uint64_t firstPage;
+    uint64_t pageCount;
+};
+
+struct ManifestDiff {
+    std::vector<PageRange> changed;
+    std::vector<const SliceManifest *> onlyInA;
+    std::vector<const SliceManifest *> onlyInB;
+
+    bool empty() const {
+        return changed.empty() && onlyInA.empty() && onlyInB.empty();
+    }
+};
+
+// Pages compare unequal when their hashes differ, or when they are
+// present in only one of the slices.
+ManifestDiff diffManifests(const Manifest &a, const Manifest &b);
+};
+
+#endif //SIGTOOL_MANIFEST_H
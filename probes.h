@@ -0,0 +1,35 @@
+#ifndef SIGTOOL_PROBES_H
+#define SIGTOOL_PROBES_H
+
+// Statically defined tracepoints under the provider "sigtool", for perf,
+// bpftrace and friends, e.g.
+//
+//   bpftrace -e 'usdt:./sigtool:sigtool:hash__end { @pages = hist(arg1); }'
+//
+// They are compiled in with the SIGTOOL_USDT build option. Otherwise they
+// only evaluate their arguments, so that values kept for a probe are not
+// reported as unused. Arguments must be integers or pointers.
+//
+//   file__open(path)
+//   parse__start(size)                 parse__end(size, slices)
+//   hash__start(sliceOffset, pages)    hash__end(sliceOffset, pages)
+//   allocate__spawn(path, pid)         allocate__exit(path, status)
+//   inject(offset, length)
+//   rename(from, to)
+//   lock__wait(path, milliseconds)
+
+#ifdef SIGTOOL_USDT
+
+#include <sys/sdt.h>
+
+#define SIGTOOL_PROBE1(name, a) DTRACE_PROBE1(sigtool, name, a)
+#define SIGTOOL_PROBE2(name, a, b) DTRACE_PROBE2(sigtool, name, a, b)
+
+#else
+
+#define SIGTOOL_PROBE1(name, a) do { (void)(a); } while (0)
+#define SIGTOOL_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+
+#endif
+
+#endif // SIGTOOL_PROBES_H
@@ -5,6 +5,8 @@
 #include <cmath>
 #include <limits>
 #include <cassert>
+#include <sstream>
+#include <stdexcept>
 #include "signature.h"
 #include "emit.h"
 
@@ -87,7 +89,7 @@ void CodeDirectory::setPageSize(uint16_t pageSize) {
 }
 
 void CodeDirectory::setCodeLimit(uint64_t codeLimit) {
-    if (codeLimit >= std::numeric_limits<uint32_t>::max()) {
+    if (codeLimit > std::numeric_limits<uint32_t>::max()) {
         data.codeLimit = std::numeric_limits<uint32_t>::max();
         data.codeLimit64 = codeLimit;
     } else {
@@ -96,12 +98,130 @@ void CodeDirectory::setCodeLimit(uint64_t codeLimit) {
     }
 }
 
+void CodeDirectory::reserveCodeSlots(uint32_t count) {
+    data.nCodeSlots = count;
+}
+
 void CodeDirectory::addCodeHash(const Hash& value) {
     codeHashes.push_back(value);
     data.nCodeSlots = codeHashes.size();
 }
 
+const Hash& CodeDirectory::getSpecialHash(int index) const {
+    return specialHashes[index - 1];
+}
+
+uint64_t CodeDirectory::codeLimit() const {
+    return data.codeLimit64 ? data.codeLimit64 : data.codeLimit;
+}
+
+static void checkRange(const std::string &bytes, uint64_t offset, uint64_t length, const char *what) {
+    if (offset > bytes.size() || length > bytes.size() - offset) {
+        throw std::runtime_error{std::string{"truncated signature reading "} + what};
+    }
+}
+
+CodeDirectory::data_t CodeDirectory::parseHeader(const std::string &bytes) {
+    data_t data{};
+
+    // The oldest code directory layout ends at spare2
+    checkRange(bytes, 0, 44, "code directory");
+    std::istringstream is{bytes};
+
+    data.magic = ReadBE::readUInt32(is);
+    data.length = ReadBE::readUInt32(is);
+    data.version = ReadBE::readUInt32(is);
+    data.flags = ReadBE::readUInt32(is);
+    data.hashOffset = ReadBE::readUInt32(is);
+    data.identOffset = ReadBE::readUInt32(is);
+    data.nSpecialSlots = ReadBE::readUInt32(is);
+    data.nCodeSlots = ReadBE::readUInt32(is);
+    data.codeLimit = ReadBE::readUInt32(is);
+    data.hashSize = Read::readBytes<uint8_t>(is);
+    data.hashType = Read::readBytes<uint8_t>(is);
+    data.platform = Read::readBytes<uint8_t>(is);
+    data.pageSize = Read::readBytes<uint8_t>(is);
+    data.spare2 = ReadBE::readUInt32(is);
+
+    if (data.magic != CSMAGIC_CODEDIRECTORY) {
+        throw std::runtime_error{"not a code directory"};
+    }
+
+    checkRange(bytes, 0, data.length, "code directory");
+
+    // Later fields are only present from the version that introduced them
+    if (data.version >= 0x20100) {
+        data.scatterOffset = ReadBE::readUInt32(is);
+    }
+    if (data.version >= 0x20200) {
+        data.teamOffset = ReadBE::readUInt32(is);
+    }
+    if (data.version >= 0x20300) {
+        data.spare3 = ReadBE::readUInt32(is);
+        data.codeLimit64 = ReadBE::readUInt64(is);
+    }
+    if (data.version >= 0x20400) {
+        data.execSegBase = ReadBE::readUInt64(is);
+        data.execSegLimit = ReadBE::readUInt64(is);
+        data.execSegFlags = ReadBE::readUInt64(is);
+    }
+
+    if (is.fail()) {
+        throw std::runtime_error{"truncated code directory header"};
+    }
+
+    return data;
+}
+
+std::shared_ptr<CodeDirectory> CodeDirectory::parse(const std::string &bytes) {
+    auto cd = std::make_shared<CodeDirectory>();
+    auto &data = cd->data;
+    data = parseHeader(bytes);
+
+    if (data.hashType != Hash::hashType || data.hashSize != Hash::hashSize) {
+        throw std::runtime_error{"unsupported code directory hash type: " + std::to_string(data.hashType)};
+    }
+
+    if (data.nSpecialSlots > sizeof(cd->specialHashes) / sizeof(cd->specialHashes[0])) {
+        throw std::runtime_error{"unsupported number of special slots: " + std::to_string(data.nSpecialSlots)};
+    }
+
+    auto identEnd = bytes.find('\0', data.identOffset);
+    if (data.identOffset >= data.length || identEnd == std::string::npos || identEnd >= data.length) {
+        throw std::runtime_error{"malformed code directory identifier"};
+    }
+    cd->identifier = bytes.substr(data.identOffset, identEnd - data.identOffset);
+
+    if (data.hashOffset < sizeof(Hash::bytes) * data.nSpecialSlots) {
+        throw std::runtime_error{"malformed code directory hash offset"};
+    }
+    checkRange(bytes, data.hashOffset - sizeof(Hash::bytes) * data.nSpecialSlots,
+               sizeof(Hash::bytes) * ((uint64_t)data.nSpecialSlots + data.nCodeSlots), "hashes");
+
+    for (unsigned int slot = 1; slot <= data.nSpecialSlots; slot++) {
+        memcpy(cd->specialHashes[slot - 1].bytes,
+               &bytes[data.hashOffset - slot * sizeof(Hash::bytes)], sizeof(Hash::bytes));
+    }
+
+    cd->codeHashes.resize(data.nCodeSlots);
+    for (unsigned int page = 0; page < data.nCodeSlots; page++) {
+        memcpy(cd->codeHashes[page].bytes,
+               &bytes[data.hashOffset + (size_t)page * sizeof(Hash::bytes)], sizeof(Hash::bytes));
+    }
+
+    return cd;
+}
+
 void SuperBlob::emit(std::ostream& os)  {
+    emitHeader(os);
+
+    for (const auto& blob : blobs) {
+        // blob data
+        blob->emit(os);
+    }
+}
+
+void SuperBlob::emitHeader(std::ostream& os)  {
     EmitBE::writeUInt32(os, CSMAGIC_EMBEDDED_SIGNATURE);
     EmitBE::writeUInt32(os, length());
     EmitBE::writeUInt32(os, blobs.size());
@@ -116,11 +236,6 @@ void SuperBlob::emit(std::ostream& os)  {
         EmitBE::writeUInt32(os, blobDataOffset);
         blobDataOffset += blob->length();
     }
-
-    for (const auto& blob : blobs) {
-        // blob data
-        blob->emit(os);
-    }
 }
 
 size_t SuperBlob::length() {
@@ -133,6 +248,84 @@ size_t SuperBlob::length() {
     return length;
 }
 
+std::vector<SuperBlob::IndexEntry> SuperBlob::parseIndex(const std::string &bytes) {
+    checkRange(bytes, 0, SuperBlob::headerSize, "superblob header");
+    std::istringstream is{bytes};
+
+    uint32_t magic = ReadBE::readUInt32(is);
+    uint32_t length = ReadBE::readUInt32(is);
+    uint32_t count = ReadBE::readUInt32(is);
+
+    if (magic != CSMAGIC_EMBEDDED_SIGNATURE) {
+        throw std::runtime_error{"not an embedded signature: " + std::to_string(magic)};
+    }
+
+    checkRange(bytes, 0, length, "superblob");
+    checkRange(bytes, SuperBlob::headerSize, 2 * sizeof(uint32_t) * (uint64_t)count, "superblob index");
+
+    std::vector<IndexEntry> index;
+    for (uint32_t i = 0; i < count; i++) {
+        IndexEntry entry{};
+        entry.type = static_cast<CSSlot>(ReadBE::readUInt32(is));
+        entry.offset = ReadBE::readUInt32(is);
+        checkRange(bytes, entry.offset, 2 * sizeof(uint32_t), "blob header");
+        index.push_back(entry);
+    }
+
+    return index;
+}
+
+SuperBlob SuperBlob::parse(const std::string &bytes) {
+    SuperBlob sb{};
+
+    for (const auto &entry : parseIndex(bytes)) {
+        std::istringstream blobHeader{bytes.substr(entry.offset, 2 * sizeof(uint32_t))};
+        uint32_t blobMagic = ReadBE::readUInt32(blobHeader);
+        uint32_t blobLength = ReadBE::readUInt32(blobHeader);
+        checkRange(bytes, entry.offset, blobLength, "blob");
+
+        std::string blobBytes = bytes.substr(entry.offset, blobLength);
+
+        if (entry.type == CSSLOT_CODEDIRECTORY && blobMagic == CSMAGIC_CODEDIRECTORY) {
+            sb.blobs.push_back(CodeDirectory::parse(blobBytes));
+        } else if (entry.type == CSSLOT_ENTITLEMENTS && blobMagic == CSMAGIC_EMBEDDED_ENTITLEMENTS && blobLength >= 8) {
+            sb.blobs.push_back(std::make_shared<Entitlements>(blobBytes.substr(8)));
+        } else {
+            sb.blobs.push_back(std::make_shared<RawBlob>(entry.type, blobBytes));
+        }
+    }
+
+    return sb;
+}
+
+std::string SuperBlob::blobBytes(const std::string &bytes, CSSlot slot) {
+    for (const auto &entry : parseIndex(bytes)) {
+        if (entry.type != slot) {
+            continue;
+        }
+
+        std::istringstream blobHeader{bytes.substr(entry.offset, 2 * sizeof(uint32_t))};
+        ReadBE::readUInt32(blobHeader); // magic
+        uint32_t blobLength = ReadBE::readUInt32(blobHeader);
+        checkRange(bytes, entry.offset, blobLength, "blob");
+        return bytes.substr(entry.offset, blobLength);
+    }
+    return std::string{};
+}
+
+std::shared_ptr<Blob> SuperBlob::findBlob(CSSlot slot) const {
+    for (const auto &blob : blobs) {
+        if (blob->slotType() == slot) {
+            return blob;
+        }
+    }
+    return std::shared_ptr<Blob>{};
+}
+
+std::shared_ptr<CodeDirectory> SuperBlob::codeDirectory() const {
+    return std::dynamic_pointer_cast<CodeDirectory>(findBlob(CSSLOT_CODEDIRECTORY));
+}
+
 void Requirements::emit(std::ostream &os) {
     EmitBE::writeUInt32(os, CSMAGIC_REQUIREMENTS);
     EmitBE::writeUInt32(os, length());
@@ -161,4 +354,12 @@ void Entitlements::emit(std::ostream &os) {
 size_t Entitlements::length() {
     return entitlements.length() + 8;
 }
+
+void RawBlob::emit(std::ostream &os) {
+    os << bytes;
+}
+
+size_t RawBlob::length() {
+    return bytes.length();
+}
 };
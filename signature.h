@@ -21,6 +21,8 @@ struct Blob : public Emittable {
     virtual CSSlot slotType() = 0;
 };
 
+struct CodeDirectory;
+
 struct SuperBlob : public Emittable {
     constexpr static const int headerSize = 3 * sizeof(uint32_t);
 
@@ -28,6 +30,25 @@ struct SuperBlob : public Emittable {
 
     void emit(std::ostream &os) override;
     size_t length() override;
+
+    // The magic, length and index, which the blobs follow in order
+    void emitHeader(std::ostream &os);
+
+    struct IndexEntry {
+        CSSlot type;
+        uint32_t offset;
+    };
+
+    // Parse an existing embedded signature. The code directory and
+    // entitlements are decoded, any other blobs are carried verbatim.
+    static SuperBlob parse(const std::string &bytes);
+    static std::vector<IndexEntry> parseIndex(const std::string &bytes);
+
+    // The raw bytes of the first blob in the given slot, empty if absent
+    static std::string blobBytes(const std::string &bytes, CSSlot slot);
+
+    std::shared_ptr<Blob> findBlob(CSSlot slot) const;
+    std::shared_ptr<CodeDirectory> codeDirectory() const;
 };
 
 struct CodeDirectory : public Blob {
@@ -58,6 +79,12 @@ struct CodeDirectory : public Blob {
 
     CodeDirectory() noexcept;
 
+    // Parse a code directory blob, throws if the hash type is not supported.
+    static std::shared_ptr<CodeDirectory> parse(const std::string &bytes);
+
+    // Parse only the fixed fields, for any hash type
+    static data_t parseHeader(const std::string &bytes);
+
     CSSlot slotType() override {
         return CSSLOT_CODEDIRECTORY;
     }
@@ -68,6 +95,12 @@ struct CodeDirectory : public Blob {
     void setPageSize(uint16_t pageSize);
     void setCodeLimit(uint64_t codeLimit);
     void addCodeHash(const Hash& value);
+    // Lay out slots for hashes which are written elsewhere as they are
+    // produced; emit then writes everything up to the code hashes.
+    void reserveCodeSlots(uint32_t count);
+
+    const Hash& getSpecialHash(int index) const;
+    uint64_t codeLimit() const;
 
     std::string identifier;
     std::vector<Hash> codeHashes;
@@ -99,6 +132,22 @@ struct Entitlements : public Blob {
     size_t length() override;
 };
 
+// A blob read from an existing signature that is not otherwise understood
+struct RawBlob : public Blob {
+    CSSlot slot;
+    std::string bytes;
+
+    RawBlob(CSSlot slot, std::string bytes)
+            : slot{slot}, bytes{std::move(bytes)} {}
+
+    CSSlot slotType() override {
+        return slot;
+    }
+
+    void emit(std::ostream &os) override;
+    size_t length() override;
+};
+
 // Only empty signatures supported
 struct Signature : public Blob {
     CSSlot slotType() override {
@@ -0,0 +1,363 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <sys/stat.h>
+#include <utility>
+
+#include "archive.h"
+#include "signer.h"
+
+namespace SigTool {
+
+std::string readFile(const std::string &filename) {
+    std::ifstream in{filename, std::ifstream::in | std::ifstream::binary};
+    if (!in.is_open()) {
+        throw std::runtime_error{"Failed opening file for read: '"
+                                 + filename + "' :" + strerror(errno)};
+    }
+
+    std::string str;
+
+    in.seekg(0, std::ifstream::end);
+    str.resize(in.tellg());
+    in.seekg(0, std::ifstream::beg);
+    in.read(&str[0], str.size());
+
+    return str;
+}
+
+// Entitlements are usually shared by every file signed in a process, as in
+// watch mode, so keep them resident while the file is unchanged.
+std::string readEntitlements(const std::string &filename) {
+    struct CachedFile {
+        dev_t device;
+        ino_t inode;
+        off_t size;
+        struct timespec mtime;
+        std::string contents;
+    };
+
+    static std::mutex mutex;
+    static std::map<std::string, CachedFile> cache;
+
+    struct stat st{};
+    if (stat(filename.c_str(), &st) != 0) {
+        throw std::runtime_error{"Failed opening file for read: '"
+                                 + filename + "' :" + strerror(errno)};
+    }
+
+#ifdef __APPLE__
+    struct timespec mtime = st.st_mtimespec;
+#else
+    struct timespec mtime = st.st_mtim;
+#endif
+
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto cached = cache.find(filename);
+        if (cached != cache.end() &&
+            cached->second.device == st.st_dev && cached->second.inode == st.st_ino &&
+            cached->second.size == st.st_size &&
+            cached->second.mtime.tv_sec == mtime.tv_sec && cached->second.mtime.tv_nsec == mtime.tv_nsec) {
+            return cached->second.contents;
+        }
+    }
+
+    CachedFile file{st.st_dev, st.st_ino, st.st_size, mtime, readFile(filename)};
+
+    std::lock_guard<std::mutex> lock{mutex};
+    cache[filename] = file;
+    return file.contents;
+}
+
+Hash hashBlob(const std::shared_ptr<Blob> &blob) {
+    std::basic_ostringstream<char> buf;
+    blob->emit(buf);
+    return Hash{buf.str()};
+}
+
+size_t codeLimitOf(const std::shared_ptr<MachO> &target) {
+    auto codeSignature = target->getCodeSignatureLoadCommand();
+    if (codeSignature) {
+        return codeSignature->data.dataOff;
+    }
+    return target->size;
+}
+
+unsigned int pageCountOf(size_t limit) {
+    return (limit + (pageSize - 1)) / pageSize;
+}
+
+std::shared_ptr<CodeDirectory> prepareCodeDirectory(
+        const Commands::SignOptions &options,
+        const std::shared_ptr<MachO> &target
+) {
+    auto codeDirectory = std::make_shared<CodeDirectory>();
+
+    codeDirectory->identifier = options.identifier.empty() ? options.filename : options.identifier;
+    codeDirectory->setPageSize(pageSize);
+
+    // TOOD: is this sane?
+    if (target->header.filetype == MH_EXECUTE) {
+        codeDirectory->data.execSegFlags |= CS_EXECSEG_MAIN_BINARY;
+    }
+
+    auto textSegment = target->getSegment64LoadCommand("__TEXT");
+    if (textSegment) {
+        codeDirectory->data.execSegBase = textSegment->data.fileoff;
+        codeDirectory->data.execSegLimit = textSegment->data.fileoff + textSegment->data.filesize;
+    }
+
+    codeDirectory->setCodeLimit(codeLimitOf(target));
+
+    return codeDirectory;
+}
+
+void addSpecialBlobs(
+        const Commands::SignOptions &options,
+        const std::shared_ptr<CodeDirectory> &codeDirectory,
+        SuperBlob &sb
+) {
+    // blob 2: requirements index with 0 entries
+    auto requirements = std::make_shared<Requirements>();
+    codeDirectory->setSpecialHash(requirements->slotType(), hashBlob(requirements));
+    sb.blobs.push_back(requirements);
+
+    // optional blob: entitlements
+    if (!options.entitlements.empty()) {
+        auto entitlements = std::make_shared<Entitlements>(readEntitlements(options.entitlements));
+        codeDirectory->setSpecialHash(entitlements->slotType(), hashBlob(entitlements));
+        sb.blobs.push_back(entitlements);
+    }
+
+    // optional special slots sealing a bundle's Info.plist and resources
+    if (!options.infoPlist.empty()) {
+        codeDirectory->setSpecialHash(CSSLOT_INFOSLOT, Hash{readFile(options.infoPlist)});
+    }
+    if (!options.resources.empty()) {
+        codeDirectory->setSpecialHash(CSSLOT_RESOURCEDIR, Hash{readFile(options.resources)});
+    }
+
+    // blob: empty signature slot
+    sb.blobs.emplace_back(std::make_shared<Signature>());
+}
+
+SuperBlob prepareSignature(const Commands::SignOptions &options, const std::shared_ptr<MachO> &target) {
+    SuperBlob sb{};
+    auto codeDirectory = prepareCodeDirectory(options, target);
+    codeDirectory->reserveCodeSlots(pageCountOf(codeLimitOf(target)));
+    sb.blobs.push_back(codeDirectory);
+    addSpecialBlobs(options, codeDirectory, sb);
+    return sb;
+}
+
+void checkReservation(const std::shared_ptr<MachO> &macho, SuperBlob &sb) {
+    auto codeSignature = macho->getCodeSignatureLoadCommand();
+
+    if (!codeSignature) {
+        throw std::runtime_error{"cannot inject signature without appropriate load command"};
+    }
+
+    if (sb.length() > codeSignature->data.dataSize) {
+        throw std::runtime_error{
+                std::string{"allocated size too small: need "}
+                + std::to_string(sb.length())
+                + std::string{" but have "}
+                + std::to_string(codeSignature->data.dataSize)
+        };
+    }
+}
+
+std::string signatureBytes(const std::shared_ptr<MachO> &macho, SuperBlob &sb) {
+    checkReservation(macho, sb);
+    auto codeSignature = macho->getCodeSignatureLoadCommand();
+
+    std::ostringstream buf;
+    sb.emit(buf);
+
+    // Clear out the rest of the reservation, which may still hold the tail
+    // of a previous, larger signature.
+    std::string bytes = buf.str();
+    bytes.resize(codeSignature->data.dataSize, '\0');
+    return bytes;
+}
+
+SigningStreamBuf::SigningStreamBuf(std::streambuf &sink, Commands::SignOptions options)
+        : sink(sink), options(std::move(options)), buffer(64 * 1024) {
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+SigningStreamBuf::int_type SigningStreamBuf::overflow(int_type c) {
+    flushBuffer();
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize SigningStreamBuf::xsputn(const char *s, std::streamsize n) {
+    if (n < epptr() - pptr()) {
+        std::copy(s, s + n, pptr());
+        pbump(n);
+    } else {
+        // Large writes bypass the buffer
+        flushBuffer();
+        consume(s, n);
+    }
+    return n;
+}
+
+SigningStreamBuf::pos_type SigningStreamBuf::seekoff(off_type off, std::ios_base::seekdir dir,
+                                                     std::ios_base::openmode which) {
+    // Only telling the position is supported; the file is written in order
+    if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::out)) {
+        return pos_type(off_type(-1));
+    }
+    return pos_type(position + (pptr() - pbase()));
+}
+
+int SigningStreamBuf::sync() {
+    flushBuffer();
+    return sink.pubsync();
+}
+
+void SigningStreamBuf::flushBuffer() {
+    consume(pbase(), pptr() - pbase());
+    setp(buffer.data(), buffer.data() + buffer.size());
+}
+
+void SigningStreamBuf::consume(const char *data, size_t len) {
+    if (finished) {
+        throw std::runtime_error{"write after the signature was emitted"};
+    }
+
+    while (len > 0) {
+        if (!macho) {
+            size_t take = std::min(len, headersNeeded() - headers.size());
+            headers.append(data, take);
+            // The load commands precede any signature reservation
+            pass(data, take);
+            // Once the fixed header is in, more is needed for the load commands
+            if (headers.size() == headersNeeded()) {
+                parseHeaders();
+            }
+            data += take;
+            len -= take;
+            continue;
+        }
+
+        uint64_t dataOff = codeSignature->data.dataOff;
+        uint64_t reservationEnd = dataOff + codeSignature->data.dataSize;
+        if (position < dataOff) {
+            size_t take = std::min<uint64_t>(len, dataOff - position);
+            pass(data, take);
+            data += take;
+            len -= take;
+        } else if (position < reservationEnd) {
+            // Whatever the producer puts in the reservation is replaced by
+            // the signature
+            size_t take = std::min<uint64_t>(len, reservationEnd - position);
+            position += take;
+            data += take;
+            len -= take;
+        } else {
+            throw std::runtime_error{"data written after the signature reservation"};
+        }
+    }
+}
+
+// Forward code to the sink, hashing it a page at a time
+void SigningStreamBuf::pass(const char *data, size_t len) {
+    if (sink.sputn(data, len) != static_cast<std::streamsize>(len)) {
+        throw std::runtime_error{"writing to the underlying stream failed"};
+    }
+    position += len;
+
+    while (len > 0) {
+        size_t take = std::min<size_t>(len, pageSize - page.size());
+        page.append(data, take);
+        data += take;
+        len -= take;
+        if (page.size() == pageSize) {
+            pageHashes.emplace_back(page.data(), page.size());
+            page.clear();
+        }
+    }
+}
+
+size_t SigningStreamBuf::headersNeeded() const {
+    constexpr const size_t headerSize = sizeof(uint32_t) + sizeof(MachOHeader);
+    if (headers.size() < headerSize) {
+        return headerSize;
+    }
+    uint32_t sizeOfCmds;
+    memcpy(&sizeOfCmds, &headers[offsetof(MachOHeader, sizeOfCmds) + sizeof(uint32_t)], sizeof(sizeOfCmds));
+    return headerSize + sizeOfCmds;
+}
+
+void SigningStreamBuf::parseHeaders() {
+    uint32_t magic;
+    memcpy(&magic, headers.data(), sizeof(magic));
+    if (magic != MH_MAGIC_64) {
+        throw std::runtime_error{"only thin 64-bit Mach-O files can be signed while written"};
+    }
+
+    MemoryStream in{headers.data(), headers.size()};
+    macho = std::make_shared<MachO>(in, 0, 0);
+
+    codeSignature = macho->getCodeSignatureLoadCommand();
+    if (!codeSignature) {
+        throw std::runtime_error{"cannot sign while writing without an LC_CODE_SIGNATURE reservation"};
+    }
+    if (codeSignature->data.dataOff < headers.size()) {
+        throw std::runtime_error{"signature reservation overlaps the load commands"};
+    }
+
+    headers.clear();
+    headers.shrink_to_fit();
+}
+
+void SigningStreamBuf::finish() {
+    if (finished) {
+        return;
+    }
+    flushBuffer();
+
+    if (!macho || position < codeSignature->data.dataOff) {
+        throw std::runtime_error{"file is incomplete, cannot sign it"};
+    }
+
+    // The last page is short
+    if (!page.empty()) {
+        pageHashes.emplace_back(page.data(), page.size());
+        page.clear();
+    }
+
+    auto codeDirectory = prepareCodeDirectory(options, macho);
+    for (const auto &hash : pageHashes) {
+        codeDirectory->addCodeHash(hash);
+    }
+
+    SuperBlob sb{};
+    sb.blobs.push_back(codeDirectory);
+    addSpecialBlobs(options, codeDirectory, sb);
+
+    // Fill the reservation, including any part the producer did not write
+    std::string bytes = signatureBytes(macho, sb);
+    uint64_t written = position - codeSignature->data.dataOff;
+    if (sink.sputn(bytes.data(), bytes.size()) != static_cast<std::streamsize>(bytes.size())) {
+        throw std::runtime_error{"writing to the underlying stream failed"};
+    }
+    position += bytes.size() - written;
+    finished = true;
+
+    if (sink.pubsync() != 0) {
+        throw std::runtime_error{"flushing the underlying stream failed"};
+    }
+}
+};
@@ -0,0 +1,119 @@
+#ifndef SIGTOOL_SIGNER_H
+#define SIGTOOL_SIGNER_H
+
+#include <memory>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <vector>
+
+#include "commands.h"
+#include "hash.h"
+#include "macho.h"
+#include "signature.h"
+
+namespace SigTool {
+
+constexpr const unsigned int pageSize = 4096;
+
+// The whole contents of a file
+std::string readFile(const std::string &filename);
+
+// Entitlements file contents, cached while the file is unchanged
+std::string readEntitlements(const std::string &filename);
+
+Hash hashBlob(const std::shared_ptr<Blob> &blob);
+
+// End of the hashed code of a slice: its signature reservation, or its end
+size_t codeLimitOf(const std::shared_ptr<MachO> &target);
+
+unsigned int pageCountOf(size_t limit);
+
+// Code directory header for the target, without any hashes
+std::shared_ptr<CodeDirectory> prepareCodeDirectory(
+        const Commands::SignOptions &options,
+        const std::shared_ptr<MachO> &target
+);
+
+// Add the blobs following the code directory, and their special slot hashes
+void addSpecialBlobs(
+        const Commands::SignOptions &options,
+        const std::shared_ptr<CodeDirectory> &codeDirectory,
+        SuperBlob &sb
+);
+
+// The signature of a slice before its pages are hashed: the code directory
+// has a slot reserved for each page, so the layout and length are final
+SuperBlob prepareSignature(const Commands::SignOptions &options, const std::shared_ptr<MachO> &target);
+
+// Throws unless the slice has a reservation large enough for the signature
+void checkReservation(const std::shared_ptr<MachO> &macho, SuperBlob &sb);
+
+// The signature as it is laid out in the slice's reservation
+std::string signatureBytes(const std::shared_ptr<MachO> &macho, SuperBlob &sb);
+
+// Signs a thin Mach-O file as it is written through, so that producers of
+// binaries need not have it read back. Bytes are hashed and passed on to
+// the sink in order; whatever is written into the LC_CODE_SIGNATURE
+// reservation is dropped, and finish() fills the reservation with the
+// signature. Seeking is not supported.
+//
+// options.filename serves only as the default identifier.
+class SigningStreamBuf : public std::streambuf {
+public:
+    SigningStreamBuf(std::streambuf &sink, Commands::SignOptions options);
+
+    // Emit the signature once everything up to the reservation is written
+    void finish();
+
+protected:
+    int_type overflow(int_type c) override;
+    std::streamsize xsputn(const char *s, std::streamsize n) override;
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override;
+    int sync() override;
+
+private:
+    std::streambuf &sink;
+    Commands::SignOptions options;
+    std::vector<char> buffer;
+
+    // Logical offset of the next byte handed to consume
+    uint64_t position = 0;
+    bool finished = false;
+
+    // Header and load commands, until they can be parsed
+    std::string headers;
+    std::shared_ptr<MachO> macho;
+    std::shared_ptr<CodeSignatureLoadCommand> codeSignature;
+
+    std::string page;
+    std::vector<Hash> pageHashes;
+
+    void flushBuffer();
+    void consume(const char *data, size_t len);
+    void pass(const char *data, size_t len);
+    size_t headersNeeded() const;
+    void parseHeaders();
+};
+
+// An output stream signing the Mach-O file written through it. Failures,
+// such as input that is not a Mach-O file or a failing sink, are thrown
+// from the write rather than only setting badbit.
+class SigningWriter : public std::ostream {
+public:
+    SigningWriter(std::ostream &sink, const Commands::SignOptions &options)
+            : std::ostream(&buf), buf(*sink.rdbuf(), options) {
+        exceptions(std::ios::badbit);
+    }
+
+    // Emit the signature into the reservation
+    void close() {
+        buf.finish();
+    }
+
+private:
+    SigningStreamBuf buf;
+};
+};
+
+#endif // SIGTOOL_SIGNER_H
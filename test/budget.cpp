@@ -0,0 +1,180 @@
+// Runs a command within a wall time and peak RSS budget, optionally
+// checking its stdout against a golden file, for the CTest suite:
+//
+//   sigtool-budget [--time-ms N] [--rss-mb N] [--golden FILE [--digest]] -- COMMAND...
+//
+// With --digest the golden file holds the SHA-256 of the output rather
+// than the output itself, for outputs too large to check in. Setting
+// SIGTOOL_UPDATE_GOLDEN=1 writes the golden file instead of comparing, and
+// SIGTOOL_BUDGET_SCALE multiplies both budgets, e.g. for sanitizer builds.
+
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "hash.h"
+
+namespace {
+
+struct Options {
+    double timeMs = 0;
+    double rssMb = 0;
+    std::string golden;
+    bool digest = false;
+    std::vector<char *> command;
+};
+
+Options parseArguments(int argc, char **argv) {
+    Options options{};
+    int i = 1;
+    for (; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--") {
+            i++;
+            break;
+        } else if (arg == "--digest") {
+            options.digest = true;
+        } else if (i + 1 < argc && arg == "--time-ms") {
+            options.timeMs = std::stod(argv[++i]);
+        } else if (i + 1 < argc && arg == "--rss-mb") {
+            options.rssMb = std::stod(argv[++i]);
+        } else if (i + 1 < argc && arg == "--golden") {
+            options.golden = argv[++i];
+        } else {
+            throw std::runtime_error{"unknown argument: " + arg};
+        }
+    }
+    for (; i < argc; i++) {
+        options.command.push_back(argv[i]);
+    }
+    if (options.command.empty()) {
+        throw std::runtime_error{"no command given"};
+    }
+    options.command.push_back(nullptr);
+    return options;
+}
+
+std::string readFile(const std::string &path) {
+    std::ifstream in{path, std::ios::binary};
+    if (!in.is_open()) {
+        throw std::runtime_error{"opening " + path + ": " + strerror(errno)};
+    }
+    std::ostringstream buf;
+    buf << in.rdbuf();
+    return buf.str();
+}
+
+int run(const Options &options) {
+    double scale = 1.0;
+    if (const char *value = getenv("SIGTOOL_BUDGET_SCALE")) {
+        scale = std::stod(value);
+    }
+
+    int out[2];
+    if (pipe(out) != 0) {
+        throw std::runtime_error{std::string{"pipe: "} + strerror(errno)};
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == -1) {
+        throw std::runtime_error{std::string{"fork: "} + strerror(errno)};
+    }
+    if (pid == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        close(out[1]);
+        execvp(options.command[0], options.command.data());
+        std::cerr << options.command[0] << ": " << strerror(errno) << std::endl;
+        _exit(127);
+    }
+    close(out[1]);
+
+    // Large outputs are only digested, never held
+    std::string output;
+    SigTool::Hasher<SigTool::SHA256Hash> hasher;
+    char buf[1 << 16];
+    for (;;) {
+        ssize_t n = read(out[0], buf, sizeof(buf));
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        if (options.digest) {
+            hasher.update(buf, n);
+        } else if (!options.golden.empty()) {
+            output.append(buf, n);
+        }
+    }
+    close(out[0]);
+
+    int status;
+    struct rusage usage{};
+    while (wait4(pid, &status, 0, &usage) == -1) {
+        if (errno != EINTR) {
+            throw std::runtime_error{std::string{"wait4: "} + strerror(errno)};
+        }
+    }
+    double elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+#ifdef __APPLE__
+    double rssMb = usage.ru_maxrss / (1024.0 * 1024.0);
+#else
+    double rssMb = usage.ru_maxrss / 1024.0;
+#endif
+
+    std::cout << options.command[0] << ": " << elapsedMs << " ms, " << rssMb << " MiB max RSS" << std::endl;
+
+    int result = 0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::cout << "FAIL: exit status " << (WIFEXITED(status) ? WEXITSTATUS(status) : -1) << std::endl;
+        result = 1;
+    }
+    if (options.timeMs > 0 && elapsedMs > options.timeMs * scale) {
+        std::cout << "FAIL: over the time budget of " << options.timeMs * scale << " ms" << std::endl;
+        result = 1;
+    }
+    if (options.rssMb > 0 && rssMb > options.rssMb * scale) {
+        std::cout << "FAIL: over the RSS budget of " << options.rssMb * scale << " MiB" << std::endl;
+        result = 1;
+    }
+
+    if (!options.golden.empty() && result == 0) {
+        if (options.digest) {
+            output = hasher.finish().hex() + "\n";
+        }
+
+        const char *update = getenv("SIGTOOL_UPDATE_GOLDEN");
+        if (update && std::string{update} == "1") {
+            std::ofstream golden{options.golden, std::ios::binary | std::ios::trunc};
+            golden << output;
+            std::cout << "updated " << options.golden << std::endl;
+        } else if (output != readFile(options.golden)) {
+            std::cout << "FAIL: output differs from " << options.golden << std::endl;
+            result = 1;
+        }
+    }
+
+    return result;
+}
+}
+
+int main(int argc, char **argv) {
+    try {
+        return run(parseArguments(argc, argv));
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+}
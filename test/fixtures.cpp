@@ -0,0 +1,303 @@
+// Writes the Mach-O fixtures of the regression suite into a directory.
+// Their layout mirrors what ld64 produces closely enough for signing:
+// __TEXT with one section, __LINKEDIT last and, unless unsigned, an
+// LC_CODE_SIGNATURE reservation at its end. Contents come from a fixed
+// PRNG, so the fixtures and the signatures over them are reproducible.
+//
+// The encoding is done here rather than with libsigtool, so that the code
+// under test does not also build its own inputs.
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <utility>
+
+namespace {
+
+constexpr uint32_t cpuTypeArm64 = 0x0100000c;
+constexpr uint32_t cpuTypeX86_64 = 0x01000007;
+
+class Random {
+public:
+    explicit Random(uint64_t seed) : state(seed * 0x9e3779b97f4a7c15ull + 1) {}
+
+    std::string bytes(size_t n) {
+        std::string out(n, '\0');
+        for (size_t i = 0; i < n; i++) {
+            // xorshift64*
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            out[i] = static_cast<char>((state * 0x2545f4914f6cdd1dull) >> 56);
+        }
+        return out;
+    }
+
+private:
+    uint64_t state;
+};
+
+void le32(std::string &s, uint32_t v) {
+    for (int i = 0; i < 4; i++) {
+        s.push_back(static_cast<char>(v >> (8 * i)));
+    }
+}
+
+void le64(std::string &s, uint64_t v) {
+    le32(s, static_cast<uint32_t>(v));
+    le32(s, static_cast<uint32_t>(v >> 32));
+}
+
+void be32(std::string &s, uint32_t v) {
+    for (int i = 3; i >= 0; i--) {
+        s.push_back(static_cast<char>(v >> (8 * i)));
+    }
+}
+
+void be64(std::string &s, uint64_t v) {
+    be32(s, static_cast<uint32_t>(v >> 32));
+    be32(s, static_cast<uint32_t>(v));
+}
+
+std::string name16(const char *name) {
+    std::string s(name);
+    s.resize(16, '\0');
+    return s;
+}
+
+struct Thin {
+    uint32_t cpuType;
+    uint64_t seed;
+    // Size of __TEXT, whose first page holds the headers
+    uint64_t textSize;
+    // LC_CODE_SIGNATURE reservation, 0 for none
+    uint32_t reservation;
+    // Fill only the first and last pages of __TEXT, leaving a hole between
+    bool sparse;
+};
+
+constexpr uint64_t linkeditSize = 0x123;
+
+uint64_t signatureOffset(const Thin &thin) {
+    return (thin.textSize + linkeditSize + 0xf) & ~uint64_t{0xf};
+}
+
+uint64_t sliceSize(const Thin &thin) {
+    return thin.reservation ? signatureOffset(thin) + thin.reservation : thin.textSize + linkeditSize;
+}
+
+std::string headers(const Thin &thin) {
+    std::string text;
+    le32(text, 0x19); // LC_SEGMENT_64
+    le32(text, 72 + 80);
+    text += name16("__TEXT");
+    le64(text, 0x100000000);
+    le64(text, thin.textSize);
+    le64(text, 0);
+    le64(text, thin.textSize);
+    le32(text, 5);
+    le32(text, 5);
+    le32(text, 1); // nsects
+    le32(text, 0);
+    text += name16("__text");
+    text += name16("__TEXT");
+    le64(text, 0x100001000);
+    le64(text, thin.textSize - 0x1000);
+    le32(text, 0x1000);
+    le32(text, 4);
+    le32(text, 0);
+    le32(text, 0);
+    le32(text, 0x80000400);
+    le32(text, 0);
+    le32(text, 0);
+    le32(text, 0);
+
+    uint64_t linkeditFileSize = thin.reservation ? signatureOffset(thin) + thin.reservation - thin.textSize
+                                                 : linkeditSize;
+    std::string linkedit;
+    le32(linkedit, 0x19);
+    le32(linkedit, 72);
+    linkedit += name16("__LINKEDIT");
+    le64(linkedit, 0x100000000 + thin.textSize);
+    le64(linkedit, (linkeditFileSize + 0x3fff) & ~uint64_t{0x3fff});
+    le64(linkedit, thin.textSize);
+    le64(linkedit, linkeditFileSize);
+    le32(linkedit, 1);
+    le32(linkedit, 1);
+    le32(linkedit, 0);
+    le32(linkedit, 0);
+
+    std::string commands = text + linkedit;
+    uint32_t count = 2;
+    if (thin.reservation) {
+        le32(commands, 0x1d); // LC_CODE_SIGNATURE
+        le32(commands, 16);
+        le32(commands, static_cast<uint32_t>(signatureOffset(thin)));
+        le32(commands, thin.reservation);
+        count++;
+    }
+
+    std::string header;
+    le32(header, 0xfeedfacf);
+    le32(header, thin.cpuType);
+    le32(header, 0);
+    le32(header, 2); // MH_EXECUTE
+    le32(header, count);
+    le32(header, commands.size());
+    le32(header, 0);
+    le32(header, 0);
+    return header + commands;
+}
+
+class Output {
+public:
+    explicit Output(const std::string &path) : path(path) {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            throw std::runtime_error{path + ": " + strerror(errno)};
+        }
+    }
+
+    ~Output() {
+        close(fd);
+    }
+
+    void write(const std::string &bytes, uint64_t offset) {
+        if (pwrite(fd, bytes.data(), bytes.size(), offset) != static_cast<ssize_t>(bytes.size())) {
+            throw std::runtime_error{path + ": " + strerror(errno)};
+        }
+    }
+
+    // Extend to size, leaving a hole where nothing was written
+    void truncate(uint64_t size) {
+        if (ftruncate(fd, size) != 0) {
+            throw std::runtime_error{path + ": " + strerror(errno)};
+        }
+    }
+
+private:
+    std::string path;
+    int fd;
+};
+
+void writeThin(Output &out, const Thin &thin, uint64_t offset) {
+    Random random{thin.seed};
+    out.write(headers(thin), offset);
+    if (thin.sparse) {
+        out.write(random.bytes(0x1000), offset + 0x1000);
+        out.write(random.bytes(0x1000), offset + thin.textSize - 0x1000);
+    } else {
+        out.write(random.bytes(thin.textSize - 0x1000), offset + 0x1000);
+    }
+    out.write(random.bytes(linkeditSize), offset + thin.textSize);
+}
+
+void thinFile(const std::string &path, const Thin &thin) {
+    Output out{path};
+    writeThin(out, thin, 0);
+    out.truncate(sliceSize(thin));
+}
+
+// A universal file of two slices, the second at secondOffset
+void fatFile(const std::string &path, const Thin &first, const Thin &second, uint64_t secondOffset, bool fat64) {
+    constexpr uint64_t firstOffset = 0x4000;
+
+    std::string header;
+    be32(header, fat64 ? 0xcafebabf : 0xcafebabe);
+    be32(header, 2);
+    for (const auto &slice : {std::make_pair(first, firstOffset), std::make_pair(second, secondOffset)}) {
+        be32(header, slice.first.cpuType);
+        be32(header, 0);
+        if (fat64) {
+            be64(header, slice.second);
+            be64(header, sliceSize(slice.first));
+            be32(header, 14);
+            be32(header, 0);
+        } else {
+            be32(header, static_cast<uint32_t>(slice.second));
+            be32(header, static_cast<uint32_t>(sliceSize(slice.first)));
+            be32(header, 14);
+        }
+    }
+
+    Output out{path};
+    out.write(header, 0);
+    writeThin(out, first, firstOffset);
+    writeThin(out, second, secondOffset);
+    out.truncate(secondOffset + sliceSize(second));
+}
+
+const char *entitlements =
+        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+        "<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n"
+        "<plist version=\"1.0\">\n"
+        "<dict>\n"
+        "\t<key>com.apple.security.get-task-allow</key>\n"
+        "\t<true/>\n"
+        "</dict>\n"
+        "</plist>\n";
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        std::cerr << "usage: " << argv[0] << " DIRECTORY" << std::endl;
+        return 2;
+    }
+    std::string dir = std::string{argv[1]} + "/";
+
+    try {
+        Thin arm64{cpuTypeArm64, 1, 0x40000, 0x4000, false};
+        Thin x86_64{cpuTypeX86_64, 2, 0x30000, 0x4000, false};
+
+        thinFile(dir + "thin-arm64", arm64);
+        thinFile(dir + "thin-x86_64", x86_64);
+        fatFile(dir + "fat", arm64, x86_64, 0x4000 + ((sliceSize(arm64) + 0x3fff) & ~uint64_t{0x3fff}), false);
+
+        // Without a reservation, for codesign to allocate one
+        thinFile(dir + "unsigned-arm64", Thin{cpuTypeArm64, 3, 0x20000, 0, false});
+
+        // A reservation too small for the signature, for codesign to grow
+        thinFile(dir + "small-reservation", Thin{cpuTypeArm64, 5, 0x20000, 0x100, false});
+
+        // Unsigned slices, for codesign to add reservations to. The first
+        // ends close enough to the second that the second has to move.
+        Thin unsignedArm64{cpuTypeArm64, 6, 0x23800, 0, false};
+        fatFile(dir + "fat-unsigned", unsignedArm64, Thin{cpuTypeX86_64, 7, 0x30000, 0, false},
+                0x4000 + ((sliceSize(unsignedArm64) + 0x3fff) & ~uint64_t{0x3fff}), false);
+
+        // A 4.5 GiB slice, hashed past the 32-bit code limit
+        thinFile(dir + "large", Thin{cpuTypeArm64, 4, (uint64_t{9} << 29), 0, true});
+
+        // A 3.5 GiB slice without a reservation, for codesign to allocate
+        // one and stream the page hashes into
+        thinFile(dir + "large-unsigned", Thin{cpuTypeArm64, 8, (uint64_t{7} << 29), 0, true});
+
+        // A universal file whose second slice lies past 4 GiB
+        fatFile(dir + "fat64", arm64, x86_64, (uint64_t{1} << 32) + 0x4000, true);
+
+        // Targets of the tests which sign in place, so that those reading
+        // the fixtures above can run alongside
+        uint64_t secondOffset = 0x4000 + ((sliceSize(arm64) + 0x3fff) & ~uint64_t{0x3fff});
+        fatFile(dir + "inject-fat", arm64, x86_64, secondOffset, false);
+        fatFile(dir + "inject-fat64", arm64, x86_64, (uint64_t{1} << 32) + 0x4000, true);
+        fatFile(dir + "resign-fat", arm64, x86_64, secondOffset, false);
+        fatFile(dir + "reidentify-fat", arm64, x86_64, secondOffset, false);
+
+        // The bytes the resign tests overwrite, in the third page of the
+        // first slice's __text
+        Output ranges{dir + "resign.ranges"};
+        ranges.write("0x6000 7\n", 0);
+
+        Output plist{dir + "entitlements.plist"};
+        plist.write(entitlements, 0);
+    } catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,237 @@
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "commands.h"
+#include "workers.h"
+
+namespace SigTool {
+
+#ifdef __linux__
+
+using Clock = std::chrono::steady_clock;
+
+class Watcher {
+public:
+    explicit Watcher(const Commands::WatchOptions &options)
+            : options(options), pool(options.jobs) {
+        fd = inotify_init1(IN_CLOEXEC);
+        if (fd == -1) {
+            throw std::runtime_error{std::string{"inotify_init1: "} + strerror(errno)};
+        }
+    }
+
+    ~Watcher() {
+        close(fd);
+    }
+
+    void run() {
+        addWatches(options.directory);
+
+        std::vector<char> buf(64 * 1024);
+        for (;;) {
+            struct pollfd pfd{fd, POLLIN, 0};
+            int result = poll(&pfd, 1, timeoutMs());
+            if (result == -1 && errno != EINTR) {
+                throw std::runtime_error{std::string{"poll: "} + strerror(errno)};
+            }
+
+            if (result > 0) {
+                ssize_t len = read(fd, buf.data(), buf.size());
+                if (len == -1 && errno != EINTR && errno != EAGAIN) {
+                    throw std::runtime_error{std::string{"reading inotify events: "} + strerror(errno)};
+                }
+                for (ssize_t offset = 0; offset < len;) {
+                    auto event = reinterpret_cast<const struct inotify_event *>(&buf[offset]);
+                    handle(*event);
+                    offset += sizeof(struct inotify_event) + event->len;
+                }
+            }
+
+            dispatchSettled();
+        }
+    }
+
+private:
+    const Commands::WatchOptions &options;
+    WorkerPool pool;
+    int fd;
+
+    std::map<int, std::string> directories;
+
+    // Files written recently, and when they are considered settled
+    std::map<std::string, Clock::time_point> pending;
+
+    std::mutex mutex;
+    std::set<std::string> inFlight;
+
+    // Watches a directory tree, optionally queueing every file in it for
+    // signing when events for it may have been lost
+    void addWatches(const std::string &directory, bool queueFiles = false) {
+        int wd = inotify_add_watch(fd, directory.c_str(),
+                                   IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+        if (wd == -1) {
+            std::cerr << "watch " << directory << ": " << strerror(errno) << std::endl;
+            return;
+        }
+        directories[wd] = directory;
+
+        DIR *dir = opendir(directory.c_str());
+        if (!dir) {
+            return;
+        }
+        while (struct dirent *entry = readdir(dir)) {
+            std::string name = entry->d_name;
+            if (name == "." || name == "..") {
+                continue;
+            }
+            std::string path = directory + "/" + name;
+            struct stat st{};
+            if (lstat(path.c_str(), &st) != 0) {
+                continue;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                addWatches(path, queueFiles);
+            } else if (queueFiles && S_ISREG(st.st_mode)) {
+                pending[path] = Clock::now() + std::chrono::milliseconds(options.debounceMs);
+            }
+        }
+        closedir(dir);
+    }
+
+    void handle(const struct inotify_event &event) {
+        // The kernel dropped events, so any file may have changed unseen;
+        // signing skips those which are not Mach-O or already current.
+        if (event.mask & IN_Q_OVERFLOW) {
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                std::cerr << "inotify queue overflowed, rescanning " << options.directory << std::endl;
+            }
+            addWatches(options.directory, true);
+            return;
+        }
+
+        auto directory = directories.find(event.wd);
+        if (directory == directories.end() || event.len == 0) {
+            return;
+        }
+
+        std::string path = directory->second + "/" + event.name;
+
+        if (event.mask & IN_ISDIR) {
+            if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+                addWatches(path);
+            }
+            return;
+        }
+
+        // Only files which have finished being written are of interest;
+        // a burst of writes to the same file pushes its deadline back.
+        if (event.mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+            pending[path] = Clock::now() + std::chrono::milliseconds(options.debounceMs);
+        }
+    }
+
+    int timeoutMs() const {
+        if (pending.empty()) {
+            return -1;
+        }
+
+        auto next = Clock::time_point::max();
+        for (const auto &item : pending) {
+            next = std::min(next, item.second);
+        }
+
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(next - Clock::now()).count();
+        return wait < 0 ? 0 : static_cast<int>(wait) + 1;
+    }
+
+    void dispatchSettled() {
+        auto now = Clock::now();
+        for (auto it = pending.begin(); it != pending.end();) {
+            if (it->second > now) {
+                ++it;
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock{mutex};
+                if (inFlight.count(it->first)) {
+                    // Retry once the current signing of this file is done
+                    it->second = now + std::chrono::milliseconds(options.debounceMs);
+                    ++it;
+                    continue;
+                }
+                inFlight.insert(it->first);
+            }
+
+            std::string path = it->first;
+            pool.submit([this, path] {
+                sign(path);
+                std::lock_guard<std::mutex> lock{mutex};
+                inFlight.erase(path);
+            });
+            it = pending.erase(it);
+        }
+    }
+
+    void sign(const std::string &path) {
+        try {
+            struct stat st{};
+            // Temporary files are often renamed away before they settle
+            if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+                return;
+            }
+            if (Commands::checkRequiresSignature(path) != 0) {
+                return;
+            }
+
+            auto start = Clock::now();
+
+            // Our own writes to the file produce further events, which
+            // then find the signature current and leave the file alone.
+            Commands::CodesignOptions codesignOptions{};
+            codesignOptions.identifier = options.identifier;
+            codesignOptions.entitlements = options.entitlements;
+            codesignOptions.force = true;
+            codesignOptions.skipIfCurrent = Commands::SkipCheck::Sample;
+            Commands::codesign(codesignOptions, path);
+
+            auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start).count();
+            std::lock_guard<std::mutex> lock{mutex};
+            std::cout << path << " " << elapsed / 1000.0 << "ms" << std::endl;
+        } catch (std::exception &e) {
+            std::lock_guard<std::mutex> lock{mutex};
+            std::cerr << path << ": " << e.what() << std::endl;
+        }
+    }
+};
+
+int Commands::watch(const WatchOptions &options) {
+    Watcher watcher{options};
+    watcher.run();
+    return 0;
+}
+
+#else
+
+int Commands::watch(const WatchOptions &options) {
+    throw std::runtime_error{"watch requires inotify, which is only available on Linux"};
+}
+
+#endif
+};
@@ -0,0 +1,91 @@
+#include <algorithm>
+
+#include "workers.h"
+
+namespace SigTool {
+
+WorkerPool::WorkerPool(unsigned int count) {
+    if (count == 0) {
+        count = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    for (unsigned int i = 0; i < count; i++) {
+        threads.emplace_back(&WorkerPool::run, this);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        stopping = true;
+    }
+    available.notify_all();
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+void WorkerPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        tasks.push_back(std::move(task));
+    }
+    available.notify_one();
+}
+
+void WorkerPool::run() {
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock{mutex};
+            available.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) {
+                return;
+            }
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+void TaskGroup::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        pending++;
+    }
+
+    pool.submit([this, task] {
+        std::exception_ptr taskError;
+        if (!failed()) {
+            try {
+                task();
+            } catch (...) {
+                taskError = std::current_exception();
+            }
+        }
+
+        std::lock_guard<std::mutex> lock{mutex};
+        if (taskError && !error) {
+            error = taskError;
+        }
+        if (--pending == 0) {
+            finished.notify_all();
+        }
+    });
+}
+
+void TaskGroup::wait() {
+    std::unique_lock<std::mutex> lock{mutex};
+    finished.wait(lock, [this] { return pending == 0; });
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+bool TaskGroup::failed() {
+    std::lock_guard<std::mutex> lock{mutex};
+    return static_cast<bool>(error);
+}
+};
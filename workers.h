@@ -0,0 +1,65 @@
+#ifndef SIGTOOL_WORKERS_H
+#define SIGTOOL_WORKERS_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace SigTool {
+
+// A fixed set of threads running submitted tasks in submission order
+class WorkerPool {
+public:
+    // 0 threads means one per hardware thread
+    explicit WorkerPool(unsigned int threads = 0);
+
+    // Finishes any queued tasks before joining the threads
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    void submit(std::function<void()> task);
+
+    unsigned int size() const {
+        return threads.size();
+    }
+
+private:
+    void run();
+
+    std::mutex mutex;
+    std::condition_variable available;
+    std::deque<std::function<void()>> tasks;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+};
+
+// Tracks a set of tasks on a pool, which may themselves submit further
+// tasks to the group. The first exception thrown by any task is kept and
+// rethrown by wait, and tasks submitted after a failure are skipped.
+class TaskGroup {
+public:
+    explicit TaskGroup(WorkerPool &pool) : pool(pool) {}
+
+    void submit(std::function<void()> task);
+
+    // Block until every task has finished
+    void wait();
+
+    bool failed();
+
+private:
+    WorkerPool &pool;
+    std::mutex mutex;
+    std::condition_variable finished;
+    unsigned int pending = 0;
+    std::exception_ptr error;
+};
+};
+
+#endif //SIGTOOL_WORKERS_H